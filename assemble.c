@@ -0,0 +1,385 @@
+/* Copyright (c) 2012 Francis Russell <francis@unchartedbackwaters.co.uk>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "assemble.h"
+#include "footer_index.h"
+#include "file_info.h"
+#include "errors.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+typedef struct
+{
+  long from;
+  long to;
+  off_t join_location;
+} overlap_t;
+
+typedef struct
+{
+  long entry;
+  off_t length;
+  long matched_in;
+  long in_degree;
+  int ordered;
+  off_t assembled_length;
+  long assembled_count;
+  long predecessor;
+  off_t join_location;
+  long successor;
+  int placed;
+} segment_t;
+
+typedef struct
+{
+  size_t count;
+  size_t capacity;
+  overlap_t *overlaps;
+} overlap_list_t;
+
+static status_t add_overlap(overlap_list_t *const list, const long from, const long to, const off_t join_location)
+{
+  status_t _status = LF_INTERNAL_ERROR;
+  if (list->count == list->capacity)
+  {
+    const size_t new_capacity = (list->capacity == 0 ? 64 : 2 * list->capacity);
+    overlap_t *const new_overlaps = realloc(list->overlaps, new_capacity * sizeof(overlap_t));
+    FAIL_SYS(new_overlaps == NULL);
+    list->overlaps = new_overlaps;
+    list->capacity = new_capacity;
+  }
+
+  list->overlaps[list->count].from = from;
+  list->overlaps[list->count].to = to;
+  list->overlaps[list->count].join_location = join_location;
+  ++list->count;
+  return LF_OK;
+
+fail:
+  return _status;
+}
+
+// Scans a segment once against the footers of all the others, recording
+// every footer that validates inside it. Only the earliest offset is kept
+// for each pair of segments, as in a pairwise merge.
+static status_t scan_segment(const footer_index_t *const index, segment_t *const segments, 
+                             const long *const entry_segments, const long s, 
+                             const char *const path, overlap_list_t *const overlaps)
+{
+  status_t _status = LF_INTERNAL_ERROR;
+  const long window_size = index->window_size;
+  file_info_t info;
+  int info_open = 0;
+  FAIL_FORWARD(open_input_file(&info, path, window_size));
+  info_open = 1;
+
+  while(!hit_file_end(&info))
+  {
+    FAIL_FORWARD(advance_location(&info));
+    if (characters_handled(&info) < window_size)
+      continue;
+
+    for(long entry = first_footer_match(index, &info.checksum); entry != -1; 
+        entry = footer_match_after(index, entry, &info.checksum))
+    {
+      const long t = entry_segments[entry];
+      if (t == s || segments[t].matched_in == s)
+        continue;
+
+      int valid;
+      FAIL_FORWARD(validate_footer(index, entry, &info, &valid));
+      if (valid)
+      {
+        segments[t].matched_in = s;
+        FAIL_FORWARD(add_overlap(overlaps, t, s, characters_handled(&info)));
+      }
+    }
+  }
+
+  return close_input_file(&info);
+
+fail:
+  if (info_open)
+    close_input_file(&info);
+
+  return _status;
+}
+
+// Number of bytes the later segment of an overlap adds beyond the earlier
+static inline off_t overlap_extension(const segment_t *const segments, const overlap_t *const overlap)
+{
+  return segments[overlap->to].length - overlap->join_location;
+}
+
+// Whether the assembly ending at a is preferable to the one ending at b
+static inline int longer_assembly(const off_t a_length, const long a_count, const segment_t *const b)
+{
+  return a_length > b->assembled_length || 
+    (a_length == b->assembled_length && a_count > b->assembled_count);
+}
+
+// Orders the segments by finding the longest assembly that can be built
+// from the overlaps, preferring more segments between assemblies of equal
+// length. Overlaps that add no data (duplicated or contained
+// segments) are ignored, and every other overlap moves the end of the
+// assembly strictly forwards, so the remaining graph can only be cyclic if
+// the segments are inconsistent. Segments on such cycles are left unordered.
+static status_t order_segments(segment_t *const segments, const long segment_count, 
+                               const overlap_list_t *const overlaps, long *const last)
+{
+  status_t _status = LF_INTERNAL_ERROR;
+  long *first_out = NULL, *fill = NULL, *out_edges = NULL, *queue = NULL;
+  *last = -1;
+
+  FAIL_SYS((first_out = calloc(segment_count + 1, sizeof(long))) == NULL);
+  FAIL_SYS((fill = calloc(segment_count + 1, sizeof(long))) == NULL);
+  FAIL_SYS((out_edges = malloc((overlaps->count + 1) * sizeof(long))) == NULL);
+  FAIL_SYS((queue = malloc((segment_count + 1) * sizeof(long))) == NULL);
+
+  for(size_t o = 0; o < overlaps->count; ++o)
+  {
+    if (overlap_extension(segments, &overlaps->overlaps[o]) > 0)
+    {
+      ++first_out[overlaps->overlaps[o].from + 1];
+      ++segments[overlaps->overlaps[o].to].in_degree;
+    }
+  }
+
+  for(long s = 0; s < segment_count; ++s)
+    first_out[s + 1] += first_out[s];
+
+  for(size_t o = 0; o < overlaps->count; ++o)
+  {
+    if (overlap_extension(segments, &overlaps->overlaps[o]) > 0)
+    {
+      const long from = overlaps->overlaps[o].from;
+      out_edges[first_out[from] + fill[from]++] = o;
+    }
+  }
+
+  long queue_start = 0, queue_end = 0;
+  for(long s = 0; s < segment_count; ++s)
+  {
+    if (segments[s].entry != -1 && segments[s].in_degree == 0)
+      queue[queue_end++] = s;
+  }
+
+  while(queue_start < queue_end)
+  {
+    const long u = queue[queue_start++];
+    segments[u].ordered = 1;
+
+    if (*last == -1 || longer_assembly(segments[u].assembled_length, segments[u].assembled_count, &segments[*last]))
+      *last = u;
+
+    for(long e = first_out[u]; e < first_out[u + 1]; ++e)
+    {
+      const overlap_t *const overlap = &overlaps->overlaps[out_edges[e]];
+      const long v = overlap->to;
+      const off_t length = segments[u].assembled_length + overlap_extension(segments, overlap);
+
+      if (longer_assembly(length, segments[u].assembled_count + 1, &segments[v]))
+      {
+        segments[v].assembled_length = length;
+        segments[v].assembled_count = segments[u].assembled_count + 1;
+        segments[v].predecessor = u;
+        segments[v].join_location = overlap->join_location;
+      }
+
+      if (--segments[v].in_degree == 0)
+        queue[queue_end++] = v;
+    }
+  }
+
+  // Link the chosen assembly forwards for writing
+  for(long s = *last; s != -1 && segments[s].predecessor != -1; s = segments[s].predecessor)
+    segments[segments[s].predecessor].successor = s;
+
+  _status = LF_OK;
+
+fail:
+  free(first_out);
+  free(fill);
+  free(out_edges);
+  free(queue);
+  return _status;
+}
+
+// A segment left out of the assembly is redundant if a placed segment
+// already holds all of its data.
+static long find_container(const segment_t *const segments, const overlap_list_t *const overlaps, const long s)
+{
+  for(size_t o = 0; o < overlaps->count; ++o)
+  {
+    const overlap_t *const overlap = &overlaps->overlaps[o];
+
+    // The footer of s lies within the placed segment, past the start of s
+    if (overlap->from == s && segments[overlap->to].placed && 
+        overlap->join_location >= segments[s].length)
+      return overlap->to;
+
+    // s ends with the footer of the placed segment and is no longer than it
+    if (overlap->to == s && segments[overlap->from].placed && 
+        overlap->join_location == segments[s].length && 
+        segments[s].length <= segments[overlap->from].length)
+      return overlap->from;
+  }
+
+  return -1;
+}
+
+status_t assemble_segments(const char *const merged, char *const *const segment_paths, const int segment_count, 
+                           const long window_size, int *const all_placed)
+{
+  status_t _status = LF_INTERNAL_ERROR;
+  footer_index_t index;
+  int index_valid = 0;
+  segment_t *segments = NULL;
+  long *entry_segments = NULL;
+  overlap_list_t overlaps = { 0, 0, NULL };
+  FILE *out = NULL;
+  unsigned char *copy_buffer = NULL;
+  *all_placed = 0;
+
+  FAIL_SYS((segments = malloc(segment_count * sizeof(segment_t))) == NULL);
+  FAIL_SYS((entry_segments = malloc(segment_count * sizeof(long))) == NULL);
+  FAIL_FORWARD(init_footer_index(&index, window_size, segment_count));
+  index_valid = 1;
+
+  for(long s = 0; s < segment_count; ++s)
+  {
+    segments[s].length = 0;
+    segments[s].matched_in = -1;
+    segments[s].in_degree = 0;
+    segments[s].ordered = 0;
+    segments[s].predecessor = -1;
+    segments[s].join_location = 0;
+    segments[s].successor = -1;
+    segments[s].placed = 0;
+
+    const status_t status = add_footer(&index, segment_paths[s], &segments[s].entry);
+    if (status == LF_OK)
+    {
+      entry_segments[segments[s].entry] = s;
+      segments[s].length = index.entries[segments[s].entry].length;
+    }
+    else
+    {
+      char buffer[256];
+      lf_strerror(status, buffer, sizeof(buffer));
+      fprintf(stderr, "Skipping %s: %s\n", segment_paths[s], buffer);
+      segments[s].entry = -1;
+    }
+
+    segments[s].assembled_length = segments[s].length;
+    segments[s].assembled_count = 1;
+  }
+
+  printf("Indexed %zu segment footers using overlap window of %li bytes.\n", index.entry_count, window_size);
+
+  for(long s = 0; s < segment_count; ++s)
+  {
+    if (segments[s].entry != -1)
+      FAIL_FORWARD_MSG(scan_segment(&index, segments, entry_segments, s, segment_paths[s], &overlaps), 
+        segment_paths[s]);
+  }
+
+  printf("Found %zu overlaps between segments.\n", overlaps.count);
+
+  long last;
+  FAIL_FORWARD(order_segments(segments, segment_count, &overlaps, &last));
+  FAIL_PRED_MSG(last == -1, LF_NO_ASSEMBLY, "No segment could start an assembly.");
+
+  long first = last;
+  while(segments[first].predecessor != -1)
+    first = segments[first].predecessor;
+
+  const size_t copy_buffer_size = get_buffer_size();
+  FAIL_SYS((copy_buffer = malloc(copy_buffer_size)) == NULL);
+  out = fopen(merged, "wb");
+  FAIL_SYS_MSG(out == NULL, "Failed to open output file.");
+
+  long placed_count = 0;
+  for(long s = first; s != -1; s = segments[s].successor)
+  {
+    FILE *const in = fopen(segment_paths[s], "rb");
+    FAIL_SYS_MSG(in == NULL, segment_paths[s]);
+    const status_t status = append_file(in, segments[s].join_location, out, NULL, copy_buffer, copy_buffer_size);
+    FAIL_SYS_MSG(fclose(in) == EOF, segment_paths[s]);
+    FAIL_FORWARD_MSG(status, "Couldn't write output file.");
+    segments[s].placed = 1;
+    ++placed_count;
+
+    if (s == first)
+      printf("%s: placed first.\n", segment_paths[s]);
+    else
+      printf("%s: placed after %s, joining at offset of %ju bytes.\n", segment_paths[s], 
+        segment_paths[segments[s].predecessor], segments[s].join_location);
+  }
+
+  FILE *const written = out;
+  out = NULL;
+  FAIL_SYS_MSG(fclose(written) == EOF, "Failed to close output file after write.");
+  printf("Wrote %li of %i segments (%ju bytes) to %s.\n", placed_count, segment_count, 
+    segments[last].assembled_length, merged);
+
+  long covered_count = 0;
+  for(long s = 0; s < segment_count; ++s)
+  {
+    if (segments[s].placed)
+      continue;
+
+    const long container = find_container(segments, &overlaps, s);
+    if (container != -1)
+    {
+      printf("%s: contained within %s.\n", segment_paths[s], segment_paths[container]);
+      ++covered_count;
+    }
+    else if (segments[s].entry != -1 && !segments[s].ordered)
+    {
+      printf("%s: overlaps inconsistently with other segments and was not placed.\n", segment_paths[s]);
+    }
+    else
+    {
+      printf("%s: does not fit the assembled ordering.\n", segment_paths[s]);
+    }
+  }
+
+  *all_placed = (placed_count + covered_count == segment_count);
+  _status = LF_OK;
+
+fail:
+  if (out != NULL)
+    fclose(out);
+
+  if (index_valid)
+    free_footer_index(&index);
+
+  free(segments);
+  free(entry_segments);
+  free(overlaps.overlaps);
+  free(copy_buffer);
+  return _status;
+}
@@ -0,0 +1,131 @@
+/* Copyright (c) 2012 Francis Russell <francis@unchartedbackwaters.co.uk>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "batch.h"
+#include "footer_index.h"
+#include "file_info.h"
+#include "errors.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+// Join locations of first files that have not been found, or whose footers
+// could not be read.
+static const off_t NOT_FOUND = -1;
+static const off_t SKIPPED = -2;
+
+status_t batch_search(const char *const file2, char *const *const file1_paths, const int file1_count, 
+                      const long window_size, int *const all_found)
+{
+  status_t _status = LF_INTERNAL_ERROR;
+  footer_index_t index;
+  file_info_t f2_info;
+  int index_valid = 0, f2_open = 0;
+  off_t *join_locations = NULL;
+  int *entry_paths = NULL;
+  *all_found = 0;
+
+  FAIL_SYS((join_locations = malloc(file1_count * sizeof(off_t))) == NULL);
+  FAIL_SYS((entry_paths = malloc(file1_count * sizeof(int))) == NULL);
+  FAIL_FORWARD(init_footer_index(&index, window_size, file1_count));
+  index_valid = 1;
+
+  for(int i = 0; i < file1_count; ++i)
+  {
+    join_locations[i] = NOT_FOUND;
+
+    long entry;
+    const status_t status = add_footer(&index, file1_paths[i], &entry);
+    if (status == LF_OK)
+    {
+      entry_paths[entry] = i;
+    }
+    else
+    {
+      char buffer[256];
+      lf_strerror(status, buffer, sizeof(buffer));
+      fprintf(stderr, "Skipping %s: %s\n", file1_paths[i], buffer);
+      join_locations[i] = SKIPPED;
+    }
+  }
+
+  FAIL_FORWARD_MSG(open_input_file(&f2_info, file2, window_size), "Couldn't open second file.");
+  f2_open = 1;
+
+  printf("Searching for %zu footers using overlap window of %li bytes.\n", index.entry_count, window_size);
+
+  // A single pass over the second file, checking every footer at each offset
+  size_t remaining = index.entry_count;
+  while(remaining > 0 && !hit_file_end(&f2_info))
+  {
+    FAIL_FORWARD(advance_location(&f2_info));
+    if (characters_handled(&f2_info) < window_size)
+      continue;
+
+    for(long entry = first_footer_match(&index, &f2_info.checksum); entry != -1; 
+        entry = footer_match_after(&index, entry, &f2_info.checksum))
+    {
+      const int path = entry_paths[entry];
+      if (join_locations[path] != NOT_FOUND)
+        continue;
+
+      int valid;
+      FAIL_FORWARD(validate_footer(&index, entry, &f2_info, &valid));
+      if (valid)
+      {
+        join_locations[path] = characters_handled(&f2_info);
+        --remaining;
+      }
+    }
+  }
+
+  for(int i = 0; i < file1_count; ++i)
+  {
+    if (join_locations[i] == SKIPPED)
+      printf("%s: skipped.\n", file1_paths[i]);
+    else if (join_locations[i] != NOT_FOUND)
+      printf("%s: found join location at offset of %ju bytes into second file.\n", 
+        file1_paths[i], join_locations[i]);
+    else
+      printf("%s: failed to find overlap.\n", file1_paths[i]);
+  }
+
+  *all_found = (remaining == 0 && index.entry_count == (size_t) file1_count);
+  _status = LF_OK;
+
+fail:
+  if (f2_open)
+  {
+    const status_t status = close_input_file(&f2_info);
+    if (_status == LF_OK)
+      _status = status;
+  }
+
+  if (index_valid)
+    free_footer_index(&index);
+
+  free(join_locations);
+  free(entry_paths);
+  return _status;
+}
@@ -0,0 +1,170 @@
+/* Copyright (c) 2012 Francis Russell <francis@unchartedbackwaters.co.uk>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "budget.h"
+#include "errors.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+// Bandwidth that may be consumed in a burst after a period of idleness
+static const double IO_BURST_SECONDS = 0.1;
+
+// Smallest transfer permitted when rate limiting, however low the rate
+static const size_t MIN_IO_CHUNK = 4096;
+
+static size_t buffer_size = DEFAULT_BUFFER_SIZE;
+
+static pthread_mutex_t io_mutex = PTHREAD_MUTEX_INITIALIZER;
+static double io_rate = 0.0;
+static double io_tokens = 0.0;
+static struct timespec last_refill;
+static struct timespec start_time;
+static uintmax_t bytes_read = 0;
+static uintmax_t bytes_written = 0;
+
+static double seconds_between(const struct timespec *const start, const struct timespec *const end)
+{
+  return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+void init_budget(void)
+{
+  clock_gettime(CLOCK_MONOTONIC, &start_time);
+}
+
+// The budget is divided between every buffer that may be held at once
+status_t set_memory_budget(const size_t budget, const size_t buffer_count)
+{
+  status_t _status = LF_INTERNAL_ERROR;
+  size_t size = budget / buffer_count;
+
+  // Keep reads page-aligned in size
+  size -= size % 4096;
+  FAIL_PRED(size < MIN_BUFFER_SIZE, LF_BUDGET_TOO_SMALL);
+  buffer_size = (size > MAX_BUFFER_SIZE ? MAX_BUFFER_SIZE : size);
+  return LF_OK;
+
+fail:
+  return _status;
+}
+
+size_t get_buffer_size(void)
+{
+  return buffer_size;
+}
+
+void set_io_rate(const double bytes_per_second)
+{
+  pthread_mutex_lock(&io_mutex);
+  io_rate = bytes_per_second;
+  io_tokens = bytes_per_second * IO_BURST_SECONDS;
+  clock_gettime(CLOCK_MONOTONIC, &last_refill);
+  pthread_mutex_unlock(&io_mutex);
+}
+
+// Must be called with io_mutex held
+static void refill_tokens(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  io_tokens += seconds_between(&last_refill, &now) * io_rate;
+  last_refill = now;
+
+  if (io_tokens > io_rate * IO_BURST_SECONDS)
+    io_tokens = io_rate * IO_BURST_SECONDS;
+}
+
+// Token bucket. Each transfer is capped at the burst size and may only start
+// once the bucket is out of debt, so no more than a burst is ever moved at
+// full speed. Transfers are charged by account_io once their actual size is
+// known.
+size_t acquire_io(const size_t wanted, const size_t transfers)
+{
+  double wait = 0.0;
+  size_t permitted = wanted;
+  pthread_mutex_lock(&io_mutex);
+
+  if (io_rate > 0.0)
+  {
+    size_t limit = (size_t) (io_rate * IO_BURST_SECONDS / transfers);
+    if (limit < MIN_IO_CHUNK)
+      limit = MIN_IO_CHUNK;
+
+    if (permitted > limit)
+      permitted = limit;
+
+    refill_tokens();
+    if (io_tokens < 0.0)
+      wait = -io_tokens / io_rate;
+  }
+
+  pthread_mutex_unlock(&io_mutex);
+
+  if (wait > 0.0)
+  {
+    struct timespec delay;
+    delay.tv_sec = (time_t) wait;
+    delay.tv_nsec = (long) ((wait - delay.tv_sec) * 1e9);
+    while(nanosleep(&delay, &delay) == -1 && errno == EINTR);
+  }
+
+  return permitted;
+}
+
+void account_io(const size_t read, const size_t written)
+{
+  pthread_mutex_lock(&io_mutex);
+  bytes_read += read;
+  bytes_written += written;
+
+  if (io_rate > 0.0)
+  {
+    refill_tokens();
+    io_tokens -= (double) read + written;
+  }
+
+  pthread_mutex_unlock(&io_mutex);
+}
+
+void report_io_stats(FILE *const stream)
+{
+  static const double MB = 1048576.0;
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  pthread_mutex_lock(&io_mutex);
+  const double elapsed = seconds_between(&start_time, &now);
+  const double total = (double) bytes_read + bytes_written;
+  fprintf(stream, "Read %ju and wrote %ju bytes in %.2f seconds (%.2f MB/s", 
+    bytes_read, bytes_written, elapsed, (elapsed > 0.0 ? total / elapsed / MB : 0.0));
+
+  if (io_rate > 0.0)
+    fprintf(stream, " against a limit of %.2f MB/s", io_rate / MB);
+
+  fprintf(stream, ") using buffers of %zu bytes.\n", buffer_size);
+  pthread_mutex_unlock(&io_mutex);
+}
@@ -0,0 +1,54 @@
+/* Copyright (c) 2012 Francis Russell <francis@unchartedbackwaters.co.uk>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef BUDGET_H
+#define BUDGET_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "errors.h"
+
+// Process-wide limits on memory use and I/O bandwidth. Both are configured
+// once at startup, before any worker threads are created.
+
+static const size_t DEFAULT_BUFFER_SIZE = 4 * 1048576;
+static const size_t MIN_BUFFER_SIZE = 64 * 1024;
+static const size_t MAX_BUFFER_SIZE = 64 * 1048576;
+
+// Buffers held by each open input: two for its rolling window and a scratch
+// buffer for verification and copying. A merge holds two inputs, plus one
+// buffer for the speculative copy of the first file when it is made.
+static const size_t BUFFERS_PER_INPUT = 3;
+static const size_t BUFFERS_PER_MERGE = 2 * BUFFERS_PER_INPUT;
+static const size_t BUFFERS_PER_SPECULATION = 1;
+
+void init_budget(void);
+status_t set_memory_budget(size_t budget, size_t buffer_count);
+size_t get_buffer_size(void);
+void set_io_rate(double bytes_per_second);
+size_t acquire_io(size_t wanted, size_t transfers);
+void account_io(size_t read, size_t written);
+void report_io_stats(FILE *stream);
+
+#endif
@@ -0,0 +1,122 @@
+/* Copyright (c) 2012 Francis Russell <francis@unchartedbackwaters.co.uk>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "digest.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <nmmintrin.h>
+#define HAVE_SSE42_CRC32C
+#endif
+
+// Reversed Castagnoli polynomial
+static const uint32_t CRC32C_POLY = 0x82f63b78u;
+
+typedef uint32_t (*crc_function_t)(uint32_t crc, const unsigned char *data, size_t length);
+
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+static uint32_t crc_tables[8][256];
+static crc_function_t crc_function;
+
+// Slicing-by-8, independent of host byte order
+static uint32_t crc32c_software(uint32_t crc, const unsigned char *data, size_t length)
+{
+  while(length >= 8)
+  {
+    crc ^= (uint32_t) data[0] | ((uint32_t) data[1] << 8) | 
+           ((uint32_t) data[2] << 16) | ((uint32_t) data[3] << 24);
+    crc = crc_tables[7][crc & 0xff] ^ crc_tables[6][(crc >> 8) & 0xff] ^
+          crc_tables[5][(crc >> 16) & 0xff] ^ crc_tables[4][crc >> 24] ^
+          crc_tables[3][data[4]] ^ crc_tables[2][data[5]] ^
+          crc_tables[1][data[6]] ^ crc_tables[0][data[7]];
+    data += 8;
+    length -= 8;
+  }
+
+  while(length-- > 0)
+    crc = (crc >> 8) ^ crc_tables[0][(crc ^ *data++) & 0xff];
+
+  return crc;
+}
+
+#ifdef HAVE_SSE42_CRC32C
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *data, size_t length)
+{
+  uint64_t crc64 = crc;
+  while(length >= 8)
+  {
+    uint64_t word;
+    memcpy(&word, data, sizeof(word));
+    crc64 = _mm_crc32_u64(crc64, word);
+    data += 8;
+    length -= 8;
+  }
+
+  crc = (uint32_t) crc64;
+  while(length-- > 0)
+    crc = _mm_crc32_u8(crc, *data++);
+
+  return crc;
+}
+#endif
+
+static void init_tables(void)
+{
+  for(uint32_t i = 0; i < 256; ++i)
+  {
+    uint32_t crc = i;
+    for(int bit = 0; bit < 8; ++bit)
+      crc = (crc >> 1) ^ (crc & 1 ? CRC32C_POLY : 0);
+
+    crc_tables[0][i] = crc;
+  }
+
+  for(int k = 1; k < 8; ++k)
+  {
+    for(int i = 0; i < 256; ++i)
+      crc_tables[k][i] = (crc_tables[k-1][i] >> 8) ^ crc_tables[0][crc_tables[k-1][i] & 0xff];
+  }
+
+  crc_function = crc32c_software;
+
+#ifdef HAVE_SSE42_CRC32C
+  if (__builtin_cpu_supports("sse4.2"))
+    crc_function = crc32c_sse42;
+#endif
+}
+
+void init_digest(digest_t *const digest)
+{
+  pthread_once(&tables_once, init_tables);
+  digest->crc = 0xffffffffu;
+}
+
+void update_digest(digest_t *const digest, const unsigned char *const data, const size_t length)
+{
+  digest->crc = crc_function(digest->crc, data, length);
+}
@@ -35,7 +35,12 @@ static struct error_string error_strings[] = {
   { LF_OK,             "No error encountered." },
   { LF_INTERNAL_ERROR, "An internal error occured. Please report." },
   { LF_INVALID_WINDOW_SIZE, "Invalid checksum window size." },
-  { LF_INVALID_COMMAND_LINE_OPTION, "Invalid command line option." }
+  { LF_INVALID_COMMAND_LINE_OPTION, "Invalid command line option." },
+  { LF_FILE_TOO_SHORT, "File is shorter than the overlap window." },
+  { LF_NO_ASSEMBLY, "No ordering of the segments could be found." },
+  { LF_INVALID_MANIFEST, "Invalid manifest entry." },
+  { LF_FILE_SHRUNK, "File shrank while being read." },
+  { LF_BUDGET_TOO_SMALL, "Memory budget is too small." }
 };
 
 void lf_strerror(const int status, char *const buffer, const size_t buffer_length)
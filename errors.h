@@ -37,6 +37,11 @@ enum
   LF_INTERNAL_ERROR,
   LF_INVALID_WINDOW_SIZE,
   LF_INVALID_COMMAND_LINE_OPTION,
+  LF_FILE_TOO_SHORT,
+  LF_NO_ASSEMBLY,
+  LF_INVALID_MANIFEST,
+  LF_FILE_SHRUNK,
+  LF_BUDGET_TOO_SMALL,
   LF_SYS_ERR_START = 1000
 };
 
@@ -30,6 +30,7 @@
 #include <assert.h>
 #include <string.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 
 static int hit_buffer_end(const file_info_t *info);
 
@@ -38,16 +39,39 @@ inline int hit_buffer_end(const file_info_t *const info)
   return info->internal_offset >= info->buffer_use;
 }
 
-status_t open_input_file(file_info_t *const info, 
-                         const char *const path, 
-                         const size_t checksum_length)
+status_t alloc_file_buffers(file_info_t *const info)
 {
   status_t _status = LF_INTERNAL_ERROR;
-  FAIL_PRED(checksum_length > BUFFER_SIZE, LF_INVALID_WINDOW_SIZE);
-  info->prev_buffer = info->buffer = NULL;
+  info->prev_buffer = info->buffer = info->scratch = NULL;
+  info->buffer_size = get_buffer_size();
+
+  // The scratch buffer is used for verification and copying, so that these
+  // do not allocate for every candidate match or output file.
+  FAIL_SYS((info->prev_buffer = malloc(info->buffer_size)) == NULL);
+  FAIL_SYS((info->buffer = malloc(info->buffer_size)) == NULL);
+  FAIL_SYS((info->scratch = malloc(info->buffer_size)) == NULL);
+  return LF_OK;
 
-  FAIL_SYS((info->prev_buffer = malloc(BUFFER_SIZE)) == NULL);
-  FAIL_SYS((info->buffer = malloc(BUFFER_SIZE)) == NULL);
+fail:
+  free_file_buffers(info);
+  return _status;
+}
+
+void free_file_buffers(file_info_t *const info)
+{
+  free(info->prev_buffer);
+  free(info->buffer);
+  free(info->scratch);
+  info->prev_buffer = info->buffer = info->scratch = NULL;
+}
+
+status_t attach_input_file(file_info_t *const info,
+                           const char *const path,
+                           const size_t checksum_length)
+{
+  status_t _status = LF_INTERNAL_ERROR;
+  info->file = NULL;
+  FAIL_PRED(checksum_length > info->buffer_size, LF_INVALID_WINDOW_SIZE);
   init_checksum(&info->checksum, checksum_length);
 
   info->file = fopen(path, "rb");
@@ -59,8 +83,34 @@ status_t open_input_file(file_info_t *const info,
   return LF_OK;
 
 fail:
-  free(info->buffer);
-  free(info->prev_buffer);
+  if (info->file != NULL)
+    fclose(info->file);
+
+  return _status;
+}
+
+status_t detach_input_file(file_info_t *const info)
+{
+  status_t _status = LF_INTERNAL_ERROR;
+  FAIL_SYS(fclose(info->file) == EOF);
+  return LF_OK;
+
+fail:
+  return _status;
+}
+
+status_t open_input_file(file_info_t *const info,
+                         const char *const path,
+                         const size_t checksum_length)
+{
+  status_t _status = LF_INTERNAL_ERROR;
+  FAIL_PRED(checksum_length > get_buffer_size(), LF_INVALID_WINDOW_SIZE);
+  FAIL_FORWARD(alloc_file_buffers(info));
+  FAIL_FORWARD(attach_input_file(info, path, checksum_length));
+  return LF_OK;
+
+fail:
+  free_file_buffers(info);
   return _status;
 }
 
@@ -70,8 +120,12 @@ status_t seek_file(file_info_t *const info, const off_t offset)
   info->block_offset = offset;
   info->buffer_use = 0;
   info->internal_offset = 0;
-  memset(info->prev_buffer, 0, BUFFER_SIZE);
-  memset(info->buffer, 0, BUFFER_SIZE);
+
+  // Only the bytes leaving the first checksum window are ever read back, and
+  // either buffer may become the previous one.
+  const size_t cs_length = checksum_length(&info->checksum);
+  memset(info->prev_buffer + info->buffer_size - cs_length, 0, cs_length);
+  memset(info->buffer + info->buffer_size - cs_length, 0, cs_length);
   reset_checksum(&info->checksum);
   FAIL_SYS(fseeko(info->file, offset, SEEK_SET) == -1);
 
@@ -83,15 +137,8 @@ fail:
 
 status_t close_input_file(file_info_t *const info)
 {
-  status_t _status = LF_INTERNAL_ERROR;
-  free(info->prev_buffer);
-  free(info->buffer);
-  
-  FAIL_SYS(fclose(info->file) == EOF);
-  return LF_OK;
-
-fail:
-  return _status;
+  free_file_buffers(info);
+  return detach_input_file(info);
 }
 
 status_t populate_forwards(file_info_t *const file)
@@ -100,16 +147,27 @@ status_t populate_forwards(file_info_t *const file)
   if (!hit_buffer_end(file))
     return LF_OK;
 
-  file->block_offset += file->buffer_use;
-  file->internal_offset = 0;
+  // A partially filled buffer is left behind when the end of the file was
+  // reached or the read was limited by the I/O rate, so it is topped up in
+  // place.
+  if (file->buffer_use == (long) file->buffer_size)
+  {
+    file->block_offset += file->buffer_use;
+    file->internal_offset = 0;
+    file->buffer_use = 0;
 
-  unsigned char *const new_prev_buffer = file->buffer;
-  file->buffer = file->prev_buffer;
-  file->prev_buffer = new_prev_buffer;
+    unsigned char *const new_prev_buffer = file->buffer;
+    file->buffer = file->prev_buffer;
+    file->prev_buffer = new_prev_buffer;
+  }
 
-  FAIL_SYS(fseeko(file->file, file->block_offset, SEEK_SET) == -1);
-  file->buffer_use = fread(file->buffer, 1, BUFFER_SIZE, file->file);
-  FAIL_SYS(file->buffer_use != BUFFER_SIZE && ferror(file->file));
+  FAIL_SYS(fseeko(file->file, file->block_offset + file->buffer_use, SEEK_SET) == -1);
+  const size_t wanted = acquire_io(file->buffer_size - file->buffer_use, 1);
+  const size_t read = fread(file->buffer + file->buffer_use, 1, wanted, file->file);
+  FAIL_SYS(read != wanted && ferror(file->file));
+  account_io(read, 0);
+  FAIL_PRED(read == 0, LF_FILE_SHRUNK);
+  file->buffer_use += read;
   return LF_OK;
 
 fail:
@@ -136,6 +194,65 @@ status_t find_checksum_match(const file_info_t *const f1_info, file_info_t *cons
   return LF_OK;
 }
 
+status_t refresh_file_length(file_info_t *const info)
+{
+  status_t _status = LF_INTERNAL_ERROR;
+  struct stat st;
+  FAIL_SYS(fstat(fileno(info->file), &st) == -1);
+  FAIL_PRED(st.st_size < characters_handled(info), LF_FILE_SHRUNK);
+  info->total_length = st.st_size;
+  return LF_OK;
+
+fail:
+  return _status;
+}
+
+status_t checksum_footer(file_info_t *const f1_info)
+{
+  status_t _status = LF_INTERNAL_ERROR;
+  FAIL_FORWARD(seek_file(f1_info, file_length(f1_info) - checksum_length(&f1_info->checksum)));
+  while(!hit_file_end(f1_info))
+    FAIL_FORWARD(advance_location(f1_info));
+
+  return LF_OK;
+
+fail:
+  return _status;
+}
+
+status_t find_overlap(file_info_t *const f1_info, file_info_t *const f2_info, int *const found)
+{
+  status_t _status = LF_INTERNAL_ERROR;
+  FAIL_FORWARD(checksum_footer(f1_info));
+  FAIL_FORWARD(continue_search(f1_info, f2_info, found));
+  return LF_OK;
+
+fail:
+  return _status;
+}
+
+status_t continue_search(file_info_t *const f1_info, file_info_t *const f2_info, int *const found)
+{
+  status_t _status = LF_INTERNAL_ERROR;
+  const size_t cs_length = checksum_length(&f1_info->checksum);
+  assert(cs_length == checksum_length(&f2_info->checksum));
+
+  *found = 0;
+  while(!*found && !hit_file_end(f2_info))
+  {
+    FAIL_FORWARD(find_checksum_match(f1_info, f2_info, found));
+    *found = *found && (characters_handled(f2_info) >= (off_t) cs_length);
+
+    if (*found)
+      FAIL_FORWARD(validate_match(f1_info, f2_info, found));
+  }
+
+  return LF_OK;
+
+fail:
+  return _status;
+}
+
 status_t advance_location(file_info_t *const file)
 {
   status_t _status = LF_INTERNAL_ERROR;
@@ -144,7 +261,7 @@ status_t advance_location(file_info_t *const file)
   if (hit_buffer_end(file))
     FAIL_FORWARD(populate_forwards(file));
 
-  add_char_checksum(&file->checksum, 
+  add_char_checksum(&file->checksum,
     get_byte(file, -checksum_length(&file->checksum)),
     get_byte(file, 0));
 
@@ -165,7 +282,8 @@ status_t validate_match(file_info_t *const f1_info, file_info_t *const f2_info,
   FAIL_SYS(fseeko(f2_info->file, f2_info->block_offset + f2_info->internal_offset - cs_length, SEEK_SET) == -1);
 
   match_info_t match_info;
-  FAIL_FORWARD(compute_match_info(f1_info->file, f2_info->file, &match_info));
+  FAIL_FORWARD(compute_match_info(f1_info->file, f2_info->file, &match_info,
+    f1_info->scratch, f1_info->buffer_size));
   *is_valid = (match_info.matching_bytes == match_info.total_bytes);
   return LF_OK;
 
@@ -182,30 +300,34 @@ status_t get_match_info(file_info_t *const f1_info, file_info_t *const f2_info,
 
   FAIL_SYS(fseeko(f1_info->file, f1_start, SEEK_SET) == -1);
   FAIL_SYS(fseeko(f2_info->file, f2_start, SEEK_SET) == -1);
-  FAIL_FORWARD(compute_match_info(f1_info->file, f2_info->file, info));
+  FAIL_FORWARD(compute_match_info(f1_info->file, f2_info->file, info,
+    f1_info->scratch, f1_info->buffer_size));
   return LF_OK;
 
 fail:
   return _status;
 }
 
-status_t compute_match_info(FILE *const f1, FILE *const f2, match_info_t *const info)
+status_t compute_match_info(FILE *const f1, FILE *const f2, match_info_t *const info,
+                            unsigned char *const scratch, const size_t scratch_size)
 {
   status_t _status = LF_INTERNAL_ERROR;
   info->matching_bytes = 0;
   info->total_bytes = 0;
 
-  unsigned char *buffer1 = NULL;
-  unsigned char *buffer2 = NULL;
-  FAIL_SYS((buffer1 = malloc(BUFFER_SIZE)) == NULL);
-  FAIL_SYS((buffer2 = malloc(BUFFER_SIZE)) == NULL);
+  // Each file is read into one half of the scratch buffer
+  const size_t chunk_size = scratch_size / 2;
+  unsigned char *const buffer1 = scratch;
+  unsigned char *const buffer2 = scratch + chunk_size;
 
   while(!feof(f1) && !feof(f2))
   {
-    const size_t read1 = fread(buffer1, 1, BUFFER_SIZE, f1);
-    FAIL_SYS(read1 != BUFFER_SIZE && ferror(f1));
-    const size_t read2 = fread(buffer2, 1, BUFFER_SIZE, f2);
-    FAIL_SYS(read2 != BUFFER_SIZE && ferror(f2));
+    const size_t wanted = acquire_io(chunk_size, 2);
+    const size_t read1 = fread(buffer1, 1, wanted, f1);
+    FAIL_SYS(read1 != wanted && ferror(f1));
+    const size_t read2 = fread(buffer2, 1, wanted, f2);
+    FAIL_SYS(read2 != wanted && ferror(f2));
+    account_io(read1 + read2, 0);
     const size_t length = (read1 < read2 ? read1 : read2);
     info->total_bytes += length;
 
@@ -221,41 +343,44 @@ status_t compute_match_info(FILE *const f1, FILE *const f2, match_info_t *const
   _status = LF_OK;
 
 fail:
-  free(buffer1);
-  free(buffer2);
   return _status;
 }
 
-status_t write_merged_file(file_info_t *const f1_info, file_info_t *const f2_info, FILE *const out)
+status_t append_file(FILE *const in, const off_t offset, FILE *const out, digest_t *const digest,
+                     unsigned char *const buffer, const size_t buffer_size)
 {
   status_t _status = LF_INTERNAL_ERROR;
-  unsigned char *buffer = NULL;
-  FAIL_SYS(fseeko(f1_info->file, 0, SEEK_SET) == -1);
-  FAIL_SYS((buffer = malloc(BUFFER_SIZE)) == NULL);
+  FAIL_SYS(fseeko(in, offset, SEEK_SET) == -1);
 
   size_t read;
   do
   {
-    read = fread(buffer, 1, BUFFER_SIZE, f1_info->file);
-    FAIL_SYS(read != BUFFER_SIZE && ferror(f1_info->file));
+    const size_t wanted = acquire_io(buffer_size, 2);
+    read = fread(buffer, 1, wanted, in);
+    FAIL_SYS(read != wanted && ferror(in));
     const size_t written = fwrite(buffer, 1, read, out);
     FAIL_SYS(written != read);
-  }
-  while(read != 0);
+    account_io(read, written);
 
-  FAIL_SYS(fseeko(f2_info->file, f2_info->block_offset + f2_info->internal_offset, SEEK_SET) == -1);
-  do
-  {
-    read = fread(buffer, 1, BUFFER_SIZE, f2_info->file);
-    FAIL_SYS(read != BUFFER_SIZE && ferror(f2_info->file));
-    const size_t written = fwrite(buffer, 1, read, out);
-    FAIL_SYS(written != read);
+    if (digest != NULL)
+      update_digest(digest, buffer, read);
   }
   while(read != 0);
 
   _status=LF_OK;
 
 fail:
-  free(buffer);
+  return _status;
+}
+
+status_t write_merged_file(file_info_t *const f1_info, file_info_t *const f2_info, FILE *const out, digest_t *const digest)
+{
+  status_t _status = LF_INTERNAL_ERROR;
+  FAIL_FORWARD(append_file(f1_info->file, 0, out, digest, f1_info->scratch, f1_info->buffer_size));
+  FAIL_FORWARD(append_file(f2_info->file, f2_info->block_offset + f2_info->internal_offset, out, digest,
+    f2_info->scratch, f2_info->buffer_size));
+  return LF_OK;
+
+fail:
   return _status;
 }
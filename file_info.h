@@ -30,8 +30,8 @@
 #include <sys/types.h>
 #include "checksum.h"
 #include "errors.h"
-
-static const size_t BUFFER_SIZE = 4 * 1048576;
+#include "digest.h"
+#include "budget.h"
 
 typedef struct
 {
@@ -40,9 +40,11 @@ typedef struct
   off_t  block_offset;
   long internal_offset;
   long buffer_use;
+  size_t buffer_size;
   checksum_t checksum;
   unsigned char *prev_buffer;
   unsigned char *buffer;
+  unsigned char *scratch;
 
 } file_info_t;
 
@@ -52,15 +54,26 @@ typedef struct
   off_t total_bytes;
 } match_info_t;
 
+status_t alloc_file_buffers(file_info_t *info);
+void free_file_buffers(file_info_t *info);
+status_t attach_input_file(file_info_t *info, const char *path, size_t checksum_length);
+status_t detach_input_file(file_info_t *info);
 status_t open_input_file(file_info_t *info, const char *path, size_t checksum_length);
 status_t close_input_file(file_info_t *info);
 status_t seek_file(file_info_t *info, off_t offset);
 status_t populate_forwards(file_info_t *file);
+status_t refresh_file_length(file_info_t *info);
+status_t checksum_footer(file_info_t *f1_info);
+status_t find_overlap(file_info_t *f1_info, file_info_t *f2_info, int *found);
+status_t continue_search(file_info_t *f1_info, file_info_t *f2_info, int *found);
 status_t find_checksum_match(const file_info_t *f1_info, file_info_t *f2_info, int *result);
 status_t advance_location(file_info_t *file);
 status_t validate_match(file_info_t *f1_info, file_info_t *f2_info, int *result);
-status_t write_merged_file(file_info_t *f1_info, file_info_t *f2_info, FILE *out);
-status_t compute_match_info(FILE *f1, FILE *f2, match_info_t *info);
+status_t append_file(FILE *in, off_t offset, FILE *out, digest_t *digest,
+                     unsigned char *buffer, size_t buffer_size);
+status_t write_merged_file(file_info_t *f1_info, file_info_t *f2_info, FILE *out, digest_t *digest);
+status_t compute_match_info(FILE *f1, FILE *f2, match_info_t *info,
+                            unsigned char *scratch, size_t scratch_size);
 status_t get_match_info(file_info_t *f1_info, file_info_t *f2_info, match_info_t *info);
 
 static inline unsigned char get_byte(file_info_t *const info, const long offset)
@@ -68,12 +81,12 @@ static inline unsigned char get_byte(file_info_t *const info, const long offset)
   const long local_offset = info->internal_offset + offset;
 
   assert(offset <= 0);
-  assert(local_offset + BUFFER_SIZE >= 0);
+  assert(local_offset + (long) info->buffer_size >= 0);
 
   if (local_offset >= 0)
     return info->buffer[local_offset];
   else
-    return info->prev_buffer[BUFFER_SIZE + local_offset];
+    return info->prev_buffer[info->buffer_size + local_offset];
 }
 
 static inline off_t file_length(const file_info_t *const info)
@@ -0,0 +1,246 @@
+/* Copyright (c) 2012 Francis Russell <francis@unchartedbackwaters.co.uk>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "follow.h"
+#include "file_info.h"
+#include "errors.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef __linux__
+#define HAVE_INOTIFY
+#include <sys/inotify.h>
+#endif
+
+// Even with inotify, the length is rechecked at this interval in case the
+// file is on a filesystem that does not report modifications.
+static const long POLL_INTERVAL_MS = 1000;
+
+static long elapsed_ms(const struct timespec *const start)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return 1000 * (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+status_t start_follow(follow_t *const follow, const char *const path, const long idle_timeout, 
+                      const long close_grace)
+{
+  follow->idle_timeout = idle_timeout;
+  follow->close_grace = close_grace;
+  follow->closed = 0;
+  follow->completed = 0;
+  follow->watch = -1;
+  follow->inotify_fd = -1;
+
+#ifdef HAVE_INOTIFY
+  follow->inotify_fd = inotify_init();
+  if (follow->inotify_fd != -1)
+  {
+    follow->watch = inotify_add_watch(follow->inotify_fd, path, IN_MODIFY | IN_CLOSE_WRITE);
+    if (follow->watch == -1)
+    {
+      close(follow->inotify_fd);
+      follow->inotify_fd = -1;
+    }
+  }
+#else
+  (void) path;
+#endif
+
+  return LF_OK;
+}
+
+void stop_follow(follow_t *const follow)
+{
+  if (follow->inotify_fd != -1)
+    close(follow->inotify_fd);
+}
+
+#ifdef HAVE_INOTIFY
+static status_t drain_events(follow_t *const follow)
+{
+  status_t _status = LF_INTERNAL_ERROR;
+  char buffer[4096];
+  const ssize_t length = read(follow->inotify_fd, buffer, sizeof(buffer));
+  FAIL_SYS(length == -1);
+
+  for(ssize_t offset = 0; offset < length; )
+  {
+    const struct inotify_event *const event = (const struct inotify_event *) (buffer + offset);
+    if (event->mask & IN_CLOSE_WRITE)
+    {
+      follow->closed = 1;
+      clock_gettime(CLOCK_MONOTONIC, &follow->closed_at);
+    }
+    else if (event->mask & IN_MODIFY)
+    {
+      follow->closed = 0;
+    }
+
+    offset += sizeof(struct inotify_event) + event->len;
+  }
+
+  return LF_OK;
+
+fail:
+  return _status;
+}
+#endif
+
+// Without inotify, closes cannot be observed, so the file is treated as
+// closed from the last time its length or modification time changed.
+static status_t check_modified(follow_t *const follow, file_info_t *const info)
+{
+  status_t _status = LF_INTERNAL_ERROR;
+  struct stat st;
+  FAIL_SYS(fstat(fileno(info->file), &st) == -1);
+
+  if (!follow->closed || st.st_mtime != follow->last_modified)
+  {
+    follow->closed = 1;
+    follow->last_modified = st.st_mtime;
+    clock_gettime(CLOCK_MONOTONIC, &follow->closed_at);
+  }
+
+  return LF_OK;
+
+fail:
+  return _status;
+}
+
+status_t wait_for_growth(follow_t *const follow, file_info_t *const info, int *const grew)
+{
+  status_t _status = LF_INTERNAL_ERROR;
+  const off_t old_length = file_length(info);
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  *grew = 0;
+
+  while(1)
+  {
+    FAIL_FORWARD(refresh_file_length(info));
+    if (file_length(info) > old_length)
+    {
+      if (follow->inotify_fd == -1)
+        follow->closed = 0;
+
+      *grew = 1;
+      return LF_OK;
+    }
+
+    if (follow->inotify_fd == -1)
+      FAIL_FORWARD(check_modified(follow, info));
+
+    // Writers that append in separate sessions close the file between them,
+    // so a close only means it is complete once it has not been reopened
+    // for the grace period, or the idle timeout if that is shorter.
+    const long remaining_ms = 1000 * follow->idle_timeout - elapsed_ms(&start);
+    if (follow->closed && (remaining_ms <= 0 || elapsed_ms(&follow->closed_at) >= 1000 * follow->close_grace))
+    {
+      follow->completed = 1;
+      return LF_OK;
+    }
+
+    if (remaining_ms <= 0)
+      return LF_OK;
+
+    const int timeout = (remaining_ms < POLL_INTERVAL_MS ? remaining_ms : POLL_INTERVAL_MS);
+
+#ifdef HAVE_INOTIFY
+    if (follow->inotify_fd != -1)
+    {
+      struct pollfd fds;
+      fds.fd = follow->inotify_fd;
+      fds.events = POLLIN;
+      const int ready = poll(&fds, 1, timeout);
+      FAIL_SYS(ready == -1 && errno != EINTR);
+
+      if (ready > 0)
+        FAIL_FORWARD(drain_events(follow));
+
+      continue;
+    }
+#endif
+
+    poll(NULL, 0, timeout);
+  }
+
+fail:
+  return _status;
+}
+
+status_t follow_search(follow_t *const follow, file_info_t *const f1_info, file_info_t *const f2_info, int *const found)
+{
+  status_t _status = LF_INTERNAL_ERROR;
+  FAIL_FORWARD(checksum_footer(f1_info));
+
+  // The rolling state of the second file is kept, so only appended bytes are
+  // ever hashed.
+  int grew = 1;
+  while(grew)
+  {
+    FAIL_FORWARD(continue_search(f1_info, f2_info, found));
+    if (*found)
+      return LF_OK;
+
+    FAIL_FORWARD(wait_for_growth(follow, f2_info, &grew));
+  }
+
+  return LF_OK;
+
+fail:
+  return _status;
+}
+
+status_t follow_tail(follow_t *const follow, file_info_t *const f2_info, FILE *const out, digest_t *const digest, 
+                     int *const completed)
+{
+  status_t _status = LF_INTERNAL_ERROR;
+  off_t copied;
+  FAIL_SYS((copied = ftello(f2_info->file)) == -1);
+
+  int grew;
+  do
+  {
+    FAIL_FORWARD(wait_for_growth(follow, f2_info, &grew));
+    if (grew)
+    {
+      FAIL_FORWARD(append_file(f2_info->file, copied, out, digest, f2_info->scratch, f2_info->buffer_size));
+      FAIL_SYS((copied = ftello(f2_info->file)) == -1);
+    }
+  }
+  while(grew);
+
+  *completed = follow->completed;
+  return LF_OK;
+
+fail:
+  return _status;
+}
@@ -0,0 +1,58 @@
+/* Copyright (c) 2012 Francis Russell <francis@unchartedbackwaters.co.uk>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef FOLLOW_H
+#define FOLLOW_H
+
+#include <stdio.h>
+#include <time.h>
+#include <sys/types.h>
+#include "file_info.h"
+#include "errors.h"
+
+// Waits for a file that is still being written to grow, using inotify where
+// available and periodic polling otherwise. Following completes once the
+// writer has closed the file and not reopened it for the grace period. When
+// polling, the file is considered closed once neither its length nor its
+// modification time has changed for the grace period.
+
+typedef struct
+{
+  int inotify_fd;
+  int watch;
+  int closed;
+  struct timespec closed_at;
+  time_t last_modified;
+  long idle_timeout;
+  long close_grace;
+  int completed;
+} follow_t;
+
+status_t start_follow(follow_t *follow, const char *path, long idle_timeout, long close_grace);
+void stop_follow(follow_t *follow);
+status_t wait_for_growth(follow_t *follow, file_info_t *info, int *grew);
+status_t follow_search(follow_t *follow, file_info_t *f1_info, file_info_t *f2_info, int *found);
+status_t follow_tail(follow_t *follow, file_info_t *f2_info, FILE *out, digest_t *digest, int *completed);
+
+#endif
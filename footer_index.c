@@ -0,0 +1,144 @@
+/* Copyright (c) 2012 Francis Russell <francis@unchartedbackwaters.co.uk>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "footer_index.h"
+#include "file_info.h"
+#include "checksum.h"
+#include "errors.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <sys/types.h>
+
+static const size_t FOOTER_CHUNK_SIZE = 64 * 1024;
+
+status_t init_footer_index(footer_index_t *const index, const size_t window_size, const size_t capacity)
+{
+  status_t _status = LF_INTERNAL_ERROR;
+  index->entries = NULL;
+  index->buckets = NULL;
+  FAIL_PRED(window_size == 0 || window_size > get_buffer_size(), LF_INVALID_WINDOW_SIZE);
+  index->window_size = window_size;
+  index->entry_count = 0;
+  index->entry_capacity = capacity;
+
+  // Keep the load factor at or below one half
+  index->bucket_bits = 1;
+  while(((size_t) 1 << index->bucket_bits) < 2 * capacity)
+    ++index->bucket_bits;
+
+  const size_t bucket_count = (size_t) 1 << index->bucket_bits;
+  FAIL_SYS((index->entries = malloc((capacity > 0 ? capacity : 1) * sizeof(footer_entry_t))) == NULL);
+  FAIL_SYS((index->buckets = malloc(bucket_count * sizeof(long))) == NULL);
+
+  for(size_t i = 0; i < bucket_count; ++i)
+    index->buckets[i] = -1;
+
+  return LF_OK;
+
+fail:
+  free(index->entries);
+  free(index->buckets);
+  return _status;
+}
+
+void free_footer_index(footer_index_t *const index)
+{
+  free(index->entries);
+  free(index->buckets);
+}
+
+status_t add_footer(footer_index_t *const index, const char *const path, long *const entry)
+{
+  status_t _status = LF_INTERNAL_ERROR;
+  FILE *file = NULL;
+  unsigned char *chunk = NULL;
+  FAIL_PRED(index->entry_count == index->entry_capacity, LF_INTERNAL_ERROR);
+
+  footer_entry_t *const footer = &index->entries[index->entry_count];
+  footer->path = path;
+  init_checksum(&footer->checksum, index->window_size);
+
+  file = fopen(path, "rb");
+  FAIL_SYS(file == NULL);
+  FAIL_SYS(fseeko(file, 0, SEEK_END) == -1);
+  footer->length = ftello(file);
+  FAIL_PRED(footer->length < (off_t) index->window_size, LF_FILE_TOO_SHORT);
+  FAIL_SYS(fseeko(file, footer->length - index->window_size, SEEK_SET) == -1);
+  FAIL_SYS((chunk = malloc(FOOTER_CHUNK_SIZE)) == NULL);
+
+  // Equivalent to advancing a freshly seeked file_info_t over the footer,
+  // where the bytes leaving the window are all zero.
+  size_t remaining = index->window_size;
+  while(remaining > 0)
+  {
+    const size_t wanted = acquire_io(remaining < FOOTER_CHUNK_SIZE ? remaining : FOOTER_CHUNK_SIZE, 1);
+    const size_t read = fread(chunk, 1, wanted, file);
+    FAIL_SYS(read != wanted && ferror(file));
+    FAIL_PRED(read != wanted, LF_INTERNAL_ERROR);
+    account_io(read, 0);
+
+    for(size_t i = 0; i < read; ++i)
+      add_char_checksum(&footer->checksum, 0, chunk[i]);
+
+    remaining -= read;
+  }
+
+  const size_t bucket = footer_bucket(index, &footer->checksum);
+  footer->next = index->buckets[bucket];
+  index->buckets[bucket] = index->entry_count;
+  *entry = index->entry_count++;
+  _status = LF_OK;
+
+fail:
+  free(chunk);
+  if (file != NULL && fclose(file) == EOF && _status == LF_OK)
+    _status = LF_FROM_SYS_ERROR(errno);
+
+  return _status;
+}
+
+status_t validate_footer(const footer_index_t *const index, const long entry, file_info_t *const info, int *const is_valid)
+{
+  status_t _status = LF_INTERNAL_ERROR;
+  const footer_entry_t *const footer = &index->entries[entry];
+  const size_t cs_length = index->window_size;
+  assert(cs_length == checksum_length(&info->checksum));
+
+  FILE *file = NULL;
+  FAIL_SYS((file = fopen(footer->path, "rb")) == NULL);
+  FAIL_SYS(fseeko(file, footer->length - cs_length, SEEK_SET) == -1);
+  FAIL_SYS(fseeko(info->file, characters_handled(info) - cs_length, SEEK_SET) == -1);
+
+  match_info_t match_info;
+  FAIL_FORWARD(compute_match_info(file, info->file, &match_info, info->scratch, info->buffer_size));
+  *is_valid = (match_info.matching_bytes == match_info.total_bytes);
+  _status = LF_OK;
+
+fail:
+  if (file != NULL && fclose(file) == EOF && _status == LF_OK)
+    _status = LF_FROM_SYS_ERROR(errno);
+
+  return _status;
+}
@@ -0,0 +1,84 @@
+/* Copyright (c) 2012 Francis Russell <francis@unchartedbackwaters.co.uk>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef FOOTER_INDEX_H
+#define FOOTER_INDEX_H
+
+#include <sys/types.h>
+#include "checksum.h"
+#include "errors.h"
+#include "file_info.h"
+
+// Hash table of footer checksums, allowing a single rolling pass over a
+// file to be checked against the footers of many others at once.
+
+typedef struct
+{
+  const char *path;
+  off_t length;
+  checksum_t checksum;
+  long next;
+} footer_entry_t;
+
+typedef struct
+{
+  size_t window_size;
+  size_t entry_count;
+  size_t entry_capacity;
+  footer_entry_t *entries;
+  unsigned bucket_bits;
+  long *buckets;
+} footer_index_t;
+
+status_t init_footer_index(footer_index_t *index, size_t window_size, size_t capacity);
+void free_footer_index(footer_index_t *index);
+status_t add_footer(footer_index_t *index, const char *path, long *entry);
+status_t validate_footer(const footer_index_t *index, long entry, file_info_t *info, int *is_valid);
+
+static inline size_t footer_bucket(const footer_index_t *const index, const checksum_t *const c)
+{
+  // The low bits of the rolling checksum only depend on the low bits of the
+  // input, so mix before taking the top bits.
+  return (size_t) ((c->byte_sum * 0x9e3779b97f4a7c15ull) >> (64 - index->bucket_bits));
+}
+
+static inline long next_footer_match(const footer_index_t *const index, long entry, const checksum_t *const c)
+{
+  while(entry != -1 && !checksum_equal(&index->entries[entry].checksum, c))
+    entry = index->entries[entry].next;
+
+  return entry;
+}
+
+static inline long first_footer_match(const footer_index_t *const index, const checksum_t *const c)
+{
+  return next_footer_match(index, index->buckets[footer_bucket(index, c)], c);
+}
+
+static inline long footer_match_after(const footer_index_t *const index, const long entry, const checksum_t *const c)
+{
+  return next_footer_match(index, index->entries[entry].next, c);
+}
+
+#endif
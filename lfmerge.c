@@ -28,25 +28,92 @@
 #include <errno.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <inttypes.h>
 #include "file_info.h"
 #include "checksum.h"
 #include "errors.h"
+#include "batch.h"
+#include "assemble.h"
+#include "manifest.h"
+#include "follow.h"
+#include "digest.h"
+#include "speculate.h"
+#include "budget.h"
 
 static const char *desc_string = "\
 Searches for the offset of an overlap between the footer of \"file1\"\n\
 and any region in \"file2\". Since the overlap can occur at any point\n\
 in \"file2\", this is useful for instances where \"file2\" has headers\n\
 that must be discarded. If the overlap is found it is printed and the\n\
-merged file written to \"merged\", if supplied.";
+merged file written to \"merged\", if supplied.\n\
+\n\
+With -b, the footers of every \"file1\" are searched for in a single\n\
+pass over \"file2\" and the join location of each is reported.\n\
+\n\
+With -a, an unordered set of segments is ordered by the overlaps\n\
+between them and reassembled into \"merged\". Segments that do not fit\n\
+the ordering are reported.\n\
+\n\
+With -M, each line of \"manifest\" holds the tab-separated paths\n\
+file1, file2 and optionally merged. The jobs are run on a pool of\n\
+workers (-j), with at most a fixed number reading from or writing to\n\
+any one device at a time (-d). One tab-separated record is written\n\
+per job, holding the manifest line, the outcome, the join location,\n\
+the matching and overlapping byte counts and the merged file or\n\
+error.\n\
+\n\
+With -f, \"file2\" may still be being written. Only newly appended\n\
+data is scanned as it arrives and, once the overlap is found, the\n\
+merged file continues to be extended as \"file2\" grows. Following\n\
+completes when the writer closes \"file2\" and does not reopen it to\n\
+append within the close grace period (-g, in seconds). Without\n\
+inotify, \"file2\" is considered closed once neither its length nor\n\
+its modification time has changed for the grace period. If \"file2\"\n\
+instead stops growing for the idle timeout (-t, in seconds) while\n\
+still open, the merged file may be incomplete and lfmerge exits with\n\
+failure.\n\
+\n\
+A CRC32C digest of \"merged\" is computed as it is written when any\n\
+of -c (print it), -s (write it to \"merged.crc32c\") or -C (compare\n\
+it with the given hexadecimal value) are supplied. With -M, -c adds\n\
+the digest to each record.\n\
+\n\
+With -p, \"file1\" is copied to a temporary file beside \"merged\" while\n\
+\"file2\" is searched. Once the join location is found only the tail\n\
+of \"file2\" is appended before the temporary file is renamed into\n\
+place. If no overlap is found the temporary file is removed.\n\
+\n\
+Buffer sizes are derived from the memory budget given to -m, shared\n\
+between workers with -M, and reads and writes are limited to the rate\n\
+given to -r in bytes per second. Both accept K, M and G suffixes. When\n\
+either is supplied the achieved throughput is reported.";
 
 static const char *copyright = "\
 Copyright (c) 2012 Francis Russell <francis@unchartedbackwaters.co.uk>";
 
 static const long DEFAULT_OVERLAP_SIZE = 4 * 1024;
+static const long DEFAULT_DEVICE_LIMIT = 2;
+static const long DEFAULT_IDLE_TIMEOUT = 60;
+static const long DEFAULT_CLOSE_GRACE = 5;
 
 struct option_values
 {
   long window_size;
+  const char *batch_file;
+  const char *assembly_file;
+  const char *manifest_file;
+  long worker_count;
+  long device_limit;
+  int  follow;
+  long idle_timeout;
+  long close_grace;
+  int  print_digest;
+  int  digest_sidecar;
+  int  check_digest;
+  uint32_t expected_digest;
+  int  speculate;
+  size_t memory_budget;
+  size_t io_rate;
   int  first_index;
   int  arg_count;
 };
@@ -54,26 +121,162 @@ struct option_values
 static void init_default_option_values(struct option_values *const options)
 {
   options->window_size = DEFAULT_OVERLAP_SIZE;
+  options->batch_file = NULL;
+  options->assembly_file = NULL;
+  options->manifest_file = NULL;
+  options->worker_count = sysconf(_SC_NPROCESSORS_ONLN);
+  options->device_limit = DEFAULT_DEVICE_LIMIT;
+  options->follow = 0;
+  options->idle_timeout = DEFAULT_IDLE_TIMEOUT;
+  options->close_grace = DEFAULT_CLOSE_GRACE;
+  options->print_digest = 0;
+  options->digest_sidecar = 0;
+  options->check_digest = 0;
+  options->expected_digest = 0;
+  options->speculate = 0;
+  options->memory_budget = 0;
+  options->io_rate = 0;
   options->first_index = 0;
   options->arg_count = 0;
 }
 
+static status_t parse_long(const char *const str, long *const value)
+{
+  status_t _status = LF_INTERNAL_ERROR;
+  char *endptr;
+  errno = 0;
+  *value = strtol(str, &endptr, 10);
+  FAIL_SYS(errno != 0);
+  FAIL_PRED(endptr == str || *endptr != '\0', LF_INVALID_COMMAND_LINE_OPTION);
+  return LF_OK;
+
+fail:
+  return _status;
+}
+
+static status_t parse_size(const char *const str, size_t *const value)
+{
+  status_t _status = LF_INTERNAL_ERROR;
+  char *endptr;
+  errno = 0;
+  const unsigned long long parsed = strtoull(str, &endptr, 10);
+  FAIL_SYS(errno != 0);
+  FAIL_PRED(endptr == str || *str == '-', LF_INVALID_COMMAND_LINE_OPTION);
+
+  unsigned long long multiplier = 1;
+  switch(*endptr)
+  {
+    case 'G': multiplier *= 1024; /* fall through */
+    case 'M': multiplier *= 1024; /* fall through */
+    case 'K': multiplier *= 1024; ++endptr; break;
+  }
+
+  FAIL_PRED(*endptr != '\0' || parsed > ((size_t) -1) / multiplier, LF_INVALID_COMMAND_LINE_OPTION);
+  *value = parsed * multiplier;
+  return LF_OK;
+
+fail:
+  return _status;
+}
+
+static status_t parse_digest(const char *const str, uint32_t *const value)
+{
+  status_t _status = LF_INTERNAL_ERROR;
+  char *endptr;
+  errno = 0;
+  const unsigned long parsed = strtoul(str, &endptr, 16);
+  FAIL_SYS(errno != 0);
+  FAIL_PRED(endptr == str || *endptr != '\0' || parsed > 0xfffffffful, LF_INVALID_COMMAND_LINE_OPTION);
+  *value = parsed;
+  return LF_OK;
+
+fail:
+  return _status;
+}
+
 static status_t parse_options(struct option_values *const options, const int argc, char **const argv)
 {
   status_t _status = LF_INTERNAL_ERROR;
   int opt;
-  while((opt = getopt(argc, argv, "w:")) != -1)
+  while((opt = getopt(argc, argv, "w:b:a:M:j:d:ft:g:csC:pm:r:")) != -1)
   {
     switch(opt)
     {
       case 'w': 
       {
-        char *endptr;
-        errno = 0;
-        const long size = strtol(optarg, &endptr, 10);
-        FAIL_SYS(errno != 0);
-        FAIL_PRED(endptr == optarg || *endptr != '\0', LF_INVALID_COMMAND_LINE_OPTION);
-        options->window_size = size;
+        FAIL_FORWARD(parse_long(optarg, &options->window_size));
+        break;
+      }
+      case 'b':
+      {
+        options->batch_file = optarg;
+        break;
+      }
+      case 'a':
+      {
+        options->assembly_file = optarg;
+        break;
+      }
+      case 'M':
+      {
+        options->manifest_file = optarg;
+        break;
+      }
+      case 'j':
+      {
+        FAIL_FORWARD(parse_long(optarg, &options->worker_count));
+        break;
+      }
+      case 'd':
+      {
+        FAIL_FORWARD(parse_long(optarg, &options->device_limit));
+        break;
+      }
+      case 'f':
+      {
+        options->follow = 1;
+        break;
+      }
+      case 't':
+      {
+        FAIL_FORWARD(parse_long(optarg, &options->idle_timeout));
+        break;
+      }
+      case 'g':
+      {
+        FAIL_FORWARD(parse_long(optarg, &options->close_grace));
+        FAIL_PRED(options->close_grace < 0, LF_INVALID_COMMAND_LINE_OPTION);
+        break;
+      }
+      case 'c':
+      {
+        options->print_digest = 1;
+        break;
+      }
+      case 's':
+      {
+        options->digest_sidecar = 1;
+        break;
+      }
+      case 'C':
+      {
+        FAIL_FORWARD(parse_digest(optarg, &options->expected_digest));
+        options->check_digest = 1;
+        break;
+      }
+      case 'p':
+      {
+        options->speculate = 1;
+        break;
+      }
+      case 'm':
+      {
+        FAIL_FORWARD(parse_size(optarg, &options->memory_budget));
+        break;
+      }
+      case 'r':
+      {
+        FAIL_FORWARD(parse_size(optarg, &options->io_rate));
         break;
       }
       default:
@@ -91,9 +294,47 @@ fail:
   return _status;
 }
 
+static status_t write_digest_sidecar(const char *const merged, const uint32_t value)
+{
+  status_t _status = LF_INTERNAL_ERROR;
+  const char *const suffix = ".crc32c";
+  char *path = NULL;
+  FILE *sidecar = NULL;
+
+  FAIL_SYS((path = malloc(strlen(merged) + strlen(suffix) + 1)) == NULL);
+  strcpy(path, merged);
+  strcat(path, suffix);
+
+  FAIL_SYS((sidecar = fopen(path, "w")) == NULL);
+  FAIL_SYS(fprintf(sidecar, "%08" PRIx32 "  %s\n", value, merged) < 0);
+  FILE *const written = sidecar;
+  sidecar = NULL;
+  FAIL_SYS(fclose(written) == EOF);
+  _status = LF_OK;
+
+fail:
+  if (sidecar != NULL)
+    fclose(sidecar);
+
+  free(path);
+  return _status;
+}
+
+static void exit_with_stats(const struct option_values *const options, const int success)
+{
+  // Records from -M go to standard output, so keep it clean
+  if (options->memory_budget != 0 || options->io_rate != 0)
+    report_io_stats(options->manifest_file != NULL ? stderr : stdout);
+
+  exit(success ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
 static void usage()
 {
-  fprintf(stderr, "Usage: lfmerge [-w overlap_window_size] file1 file2 [merged]\n\n");
+  fprintf(stderr, "Usage: lfmerge [-w overlap_window_size] [-m memory_budget] [-r io_rate] [-f [-t idle_timeout] [-g close_grace]] [-c] [-s] [-C crc32c] [-p] file1 file2 [merged]\n");
+  fprintf(stderr, "       lfmerge [-w overlap_window_size] [-m memory_budget] [-r io_rate] -b file2 file1 [file1 ...]\n");
+  fprintf(stderr, "       lfmerge [-w overlap_window_size] [-m memory_budget] [-r io_rate] -a merged segment [segment ...]\n");
+  fprintf(stderr, "       lfmerge [-w overlap_window_size] [-m memory_budget] [-r io_rate] [-j workers] [-d jobs_per_device] [-c] -M manifest\n\n");
   fprintf(stderr, "%s\n\n", desc_string);
   fprintf(stderr, 
     "This build was configured with a default overlap size of %li bytes.\n\n", 
@@ -104,22 +345,97 @@ static void usage()
 int main(const int argc, char **const argv)
 {
   status_t _status;
+  speculation_t *active_speculation = NULL;
+  FILE *out = NULL;
   struct option_values options;
+  init_budget();
   init_default_option_values(&options);
   FAIL_FORWARD(parse_options(&options, argc, argv));
 
-  if (options.arg_count != 2 && options.arg_count != 3)
+  const int mode_count = (options.batch_file != NULL) + (options.assembly_file != NULL) + 
+    (options.manifest_file != NULL);
+  const int valid_args = (options.manifest_file != NULL ? options.arg_count == 0 :
+    mode_count != 0 ? options.arg_count >= 1 : (options.arg_count == 2 || options.arg_count == 3));
+
+  const int wants_digest = options.print_digest || options.digest_sidecar || options.check_digest;
+  const int pair_only = options.follow || options.digest_sidecar || options.check_digest || options.speculate;
+  const int writes_merged = (mode_count == 0 ? options.arg_count == 3 : options.manifest_file != NULL);
+  if (mode_count > 1 || !valid_args || 
+      (pair_only && mode_count != 0) || ((wants_digest || options.speculate) && !writes_merged))
   {
     usage();
     exit(EXIT_FAILURE);
   }
 
-  if (options.window_size <= 0 || options.window_size > BUFFER_SIZE)
+  if (options.manifest_file != NULL && (options.worker_count <= 0 || options.device_limit <= 0))
+  {
+    fprintf(stderr, "Worker count and jobs per device must be positive.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  if (options.memory_budget != 0)
+  {
+    // Batch searches and assemblies only hold one input open at a time
+    size_t buffer_count = BUFFERS_PER_MERGE;
+    if (options.manifest_file != NULL)
+      buffer_count = BUFFERS_PER_MERGE * options.worker_count;
+    else if (options.batch_file != NULL || options.assembly_file != NULL)
+      buffer_count = BUFFERS_PER_INPUT;
+    else if (options.speculate)
+      buffer_count += BUFFERS_PER_SPECULATION;
+
+    FAIL_FORWARD_MSG(set_memory_budget(options.memory_budget, buffer_count), 
+      "Couldn't fit buffers within memory budget.");
+  }
+
+  if (options.io_rate != 0)
+    set_io_rate(options.io_rate);
+
+  if (options.window_size <= 0 || options.window_size > get_buffer_size())
+  {
+    fprintf(stderr, "Overlap window size must be between 1 and %zu bytes inclusive.\n", get_buffer_size());
+    exit(EXIT_FAILURE);
+  }
+
+  if (options.follow && options.idle_timeout < 0)
   {
-    fprintf(stderr, "Overlap window size must be between 1 and %zi bytes inclusive.\n", BUFFER_SIZE);
+    fprintf(stderr, "Idle timeout cannot be negative.\n");
     exit(EXIT_FAILURE);
   }
 
+  if (options.manifest_file != NULL)
+  {
+    int all_succeeded;
+    FAIL_FORWARD(run_manifest(options.manifest_file, options.window_size, options.worker_count, 
+      options.device_limit, options.print_digest, &all_succeeded));
+    exit_with_stats(&options, all_succeeded);
+  }
+
+  if (options.batch_file != NULL)
+  {
+    int all_found;
+    FAIL_FORWARD(batch_search(options.batch_file, argv + options.first_index, options.arg_count, 
+      options.window_size, &all_found));
+    exit_with_stats(&options, all_found);
+  }
+
+  if (options.assembly_file != NULL)
+  {
+    for(int i = 0; i < options.arg_count; ++i)
+    {
+      if (strcmp(options.assembly_file, argv[options.first_index + i]) == 0)
+      {
+        fprintf(stderr, "Output file cannot also be one of the input files.\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+
+    int all_placed;
+    FAIL_FORWARD(assemble_segments(options.assembly_file, argv + options.first_index, options.arg_count, 
+      options.window_size, &all_placed));
+    exit_with_stats(&options, all_placed);
+  }
+
   const char *const file1 = argv[options.first_index];
   const char *const file2 = argv[options.first_index+1];
   const char *const file3 = (options.arg_count == 3 ? argv[options.first_index+2] : NULL);
@@ -142,24 +458,31 @@ int main(const int argc, char **const argv)
 
   FAIL_FORWARD_MSG(open_input_file(&f2_info, file2, options.window_size), "Couldn't open second file.");
 
-  // Checksum end of first file
-  FAIL_FORWARD_MSG(seek_file(&f1_info, file_length(&f1_info) - options.window_size), "Couldn't seek to footer of first file.");
+  digest_t digest;
+  init_digest(&digest);
+  digest_t *const output_digest = (wants_digest ? &digest : NULL);
 
-  printf("Performing search using overlap window of %li bytes.\n", options.window_size);
+  speculation_t speculation;
+  if (options.speculate)
+  {
+    FAIL_FORWARD_MSG(start_speculation(&speculation, file1, file3, output_digest), 
+      "Couldn't start copying first file to output.");
+    active_speculation = &speculation;
+  }
 
-  while(!hit_file_end(&f1_info))
-    FAIL_FORWARD(advance_location(&f1_info));
+  follow_t follow;
+  if (options.follow)
+    FAIL_FORWARD(start_follow(&follow, file2, options.idle_timeout, options.close_grace));
 
-  int found = 0;
-  while(!found && !hit_file_end(&f2_info))
-  {
-    FAIL_FORWARD(find_checksum_match(&f1_info, &f2_info, &found));
-    found = found && (characters_handled(&f2_info) >= options.window_size);
+  printf("Performing search using overlap window of %li bytes.\n", options.window_size);
 
-    if (found)
-      FAIL_FORWARD(validate_match(&f1_info, &f2_info, &found));
-  }
+  int found, success;
+  if (options.follow)
+    FAIL_FORWARD(follow_search(&follow, &f1_info, &f2_info, &found));
+  else
+    FAIL_FORWARD(find_overlap(&f1_info, &f2_info, &found));
 
+  success = found;
   if (found != 0)
   {
     const off_t join_location = characters_handled(&f2_info);
@@ -179,12 +502,65 @@ int main(const int argc, char **const argv)
 
     if (options.arg_count == 3)
     {
-      FILE *const out = fopen(file3, "wb");
-      FAIL_SYS_MSG(out == NULL, "Failed to open output file.");
-   
-      FAIL_FORWARD_MSG(write_merged_file(&f1_info, &f2_info, out), "Couldn't write output file.");
-      FAIL_SYS_MSG(fclose(out) == EOF, "Failed to close output file after write.");
+      if (active_speculation != NULL)
+      {
+        // The first file has already been copied, so only the tail remains
+        FAIL_FORWARD_MSG(finish_speculation(&speculation, &out), "Couldn't copy first file to output.");
+        FAIL_FORWARD_MSG(append_file(f2_info.file, characters_handled(&f2_info), out, output_digest,
+          f2_info.scratch, f2_info.buffer_size), "Couldn't write output file.");
+      }
+      else
+      {
+        out = fopen(file3, "wb");
+        FAIL_SYS_MSG(out == NULL, "Failed to open output file.");
+        FAIL_FORWARD_MSG(write_merged_file(&f1_info, &f2_info, out, output_digest), 
+          "Couldn't write output file.");
+      }
+
+      if (options.follow)
+      {
+        int completed;
+        FAIL_FORWARD_MSG(follow_tail(&follow, &f2_info, out, output_digest, &completed), 
+          "Couldn't extend output file.");
+
+        if (completed)
+        {
+          printf("Following completed with second file at %ju bytes.\n", file_length(&f2_info));
+        }
+        else
+        {
+          printf("Second file did not grow for %li seconds but was not closed. The merged file may be incomplete.\n", 
+            options.idle_timeout);
+          success = 0;
+        }
+      }
+
+      FILE *const written = out;
+      out = NULL;
+      if (active_speculation != NULL)
+      {
+        active_speculation = NULL;
+        FAIL_FORWARD_MSG(commit_speculation(&speculation, written), "Failed to move output file into place.");
+      }
+      else
+      {
+        FAIL_SYS_MSG(fclose(written) == EOF, "Failed to close output file after write.");
+      }
+
       printf("Wrote merged file %s.\n", file3);
+
+      if (options.print_digest)
+        printf("CRC32C of merged file is %08" PRIx32 ".\n", digest_value(&digest));
+
+      if (options.digest_sidecar)
+        FAIL_FORWARD_MSG(write_digest_sidecar(file3, digest_value(&digest)), "Couldn't write digest file.");
+
+      if (options.check_digest && digest_value(&digest) != options.expected_digest)
+      {
+        printf("CRC32C of merged file %08" PRIx32 " does not match expected value %08" PRIx32 ".\n", 
+          digest_value(&digest), options.expected_digest);
+        success = 0;
+      }
     }
     else
     {
@@ -196,11 +572,23 @@ int main(const int argc, char **const argv)
     printf("Failed to find overlap.\n");
   }
 
+  if (active_speculation != NULL)
+  {
+    abandon_speculation(active_speculation, NULL);
+    active_speculation = NULL;
+  }
+
+  if (options.follow)
+    stop_follow(&follow);
+
   FAIL_FORWARD_MSG(close_input_file(&f1_info), "Error closing first input file.");
   FAIL_FORWARD_MSG(close_input_file(&f2_info), "Error closing second input file.");
-  exit(found != 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+  exit_with_stats(&options, success);
 
 fail:
+  if (active_speculation != NULL)
+    abandon_speculation(active_speculation, out);
+
   {
     char buffer[256];
     lf_strerror(_status, buffer, sizeof(buffer));
@@ -0,0 +1,494 @@
+/* Copyright (c) 2012 Francis Russell <francis@unchartedbackwaters.co.uk>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "manifest.h"
+#include "file_info.h"
+#include "errors.h"
+#include "digest.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <libgen.h>
+
+enum { MAX_JOB_DEVICES = 3 };
+
+typedef struct
+{
+  unsigned long line;
+  char *file1;
+  char *file2;
+  char *merged;
+} job_t;
+
+typedef struct
+{
+  dev_t device;
+  int active;
+} device_use_t;
+
+// Limits the number of jobs using any one device at a time. All
+// devices of a job are acquired together so jobs cannot deadlock.
+typedef struct
+{
+  pthread_mutex_t mutex;
+  pthread_cond_t released;
+  int limit;
+  size_t device_count;
+  device_use_t *devices;
+} device_limiter_t;
+
+typedef struct
+{
+  long window_size;
+  int compute_digest;
+  size_t job_count;
+  job_t *jobs;
+  size_t next_job;
+  size_t failed_jobs;
+  pthread_mutex_t mutex;
+  device_limiter_t limiter;
+} manifest_t;
+
+static device_use_t *find_device(device_limiter_t *const limiter, const dev_t device)
+{
+  for(size_t i = 0; i < limiter->device_count; ++i)
+  {
+    if (limiter->devices[i].device == device)
+      return &limiter->devices[i];
+  }
+
+  device_use_t *const use = &limiter->devices[limiter->device_count++];
+  use->device = device;
+  use->active = 0;
+  return use;
+}
+
+static void acquire_devices(device_limiter_t *const limiter, const dev_t *const devices, const size_t count)
+{
+  pthread_mutex_lock(&limiter->mutex);
+
+  device_use_t *uses[MAX_JOB_DEVICES];
+  for(size_t i = 0; i < count; ++i)
+    uses[i] = find_device(limiter, devices[i]);
+
+  int available;
+  do
+  {
+    available = 1;
+    for(size_t i = 0; i < count; ++i)
+      available = available && (uses[i]->active < limiter->limit);
+
+    if (!available)
+      pthread_cond_wait(&limiter->released, &limiter->mutex);
+  }
+  while(!available);
+
+  for(size_t i = 0; i < count; ++i)
+    ++uses[i]->active;
+
+  pthread_mutex_unlock(&limiter->mutex);
+}
+
+static void release_devices(device_limiter_t *const limiter, const dev_t *const devices, const size_t count)
+{
+  pthread_mutex_lock(&limiter->mutex);
+
+  for(size_t i = 0; i < count; ++i)
+    --find_device(limiter, devices[i])->active;
+
+  pthread_cond_broadcast(&limiter->released);
+  pthread_mutex_unlock(&limiter->mutex);
+}
+
+static void add_job_device(dev_t *const devices, size_t *const count, const dev_t device)
+{
+  for(size_t i = 0; i < *count; ++i)
+  {
+    if (devices[i] == device)
+      return;
+  }
+
+  devices[(*count)++] = device;
+}
+
+// The devices read from and, for the merged file, the device of the
+// directory it will be created in.
+static status_t get_job_devices(const job_t *const job, dev_t *const devices, size_t *const count)
+{
+  status_t _status = LF_INTERNAL_ERROR;
+  char *merged_copy = NULL;
+  struct stat info;
+  *count = 0;
+
+  FAIL_SYS(stat(job->file1, &info) == -1);
+  add_job_device(devices, count, info.st_dev);
+  FAIL_SYS(stat(job->file2, &info) == -1);
+  add_job_device(devices, count, info.st_dev);
+
+  if (job->merged != NULL)
+  {
+    // dirname may modify its argument
+    FAIL_SYS((merged_copy = malloc(strlen(job->merged) + 1)) == NULL);
+    strcpy(merged_copy, job->merged);
+    FAIL_SYS(stat(dirname(merged_copy), &info) == -1);
+    add_job_device(devices, count, info.st_dev);
+  }
+
+  _status = LF_OK;
+
+fail:
+  free(merged_copy);
+  return _status;
+}
+
+// Runs a single merge using buffers owned by the calling worker
+static status_t run_job(const manifest_t *const manifest, const job_t *const job, 
+                        file_info_t *const f1_info, file_info_t *const f2_info, 
+                        int *const found, off_t *const join_location, match_info_t *const match_info, 
+                        digest_t *const digest)
+{
+  status_t _status = LF_INTERNAL_ERROR;
+  int f1_attached = 0, f2_attached = 0;
+  FILE *out = NULL;
+  *found = 0;
+
+  FAIL_FORWARD(attach_input_file(f1_info, job->file1, manifest->window_size));
+  f1_attached = 1;
+  FAIL_PRED(file_length(f1_info) < manifest->window_size, LF_FILE_TOO_SHORT);
+  FAIL_FORWARD(attach_input_file(f2_info, job->file2, manifest->window_size));
+  f2_attached = 1;
+
+  FAIL_FORWARD(find_overlap(f1_info, f2_info, found));
+  if (*found)
+  {
+    *join_location = characters_handled(f2_info);
+    FAIL_FORWARD(get_match_info(f1_info, f2_info, match_info));
+
+    if (job->merged != NULL)
+    {
+      FAIL_SYS((out = fopen(job->merged, "wb")) == NULL);
+      FAIL_FORWARD(write_merged_file(f1_info, f2_info, out, manifest->compute_digest ? digest : NULL));
+      FILE *const written = out;
+      out = NULL;
+      FAIL_SYS(fclose(written) == EOF);
+    }
+  }
+
+  _status = LF_OK;
+
+fail:
+  if (out != NULL)
+    fclose(out);
+
+  if (f2_attached)
+  {
+    const status_t status = detach_input_file(f2_info);
+    if (_status == LF_OK)
+      _status = status;
+  }
+
+  if (f1_attached)
+  {
+    const status_t status = detach_input_file(f1_info);
+    if (_status == LF_OK)
+      _status = status;
+  }
+
+  return _status;
+}
+
+static void report_job(const manifest_t *const manifest, const job_t *const job, 
+                       const status_t status, const int found, const off_t join_location, 
+                       const match_info_t *const match_info, const digest_t *const digest)
+{
+  // One record per line, written with a single call so workers do not interleave
+  if (status != LF_OK)
+  {
+    char buffer[256];
+    lf_strerror(status, buffer, sizeof(buffer));
+    printf("%lu\terror\t-\t-\t-\t%s\t-\n", job->line, buffer);
+  }
+  else if (!found)
+  {
+    printf("%lu\tno-overlap\t-\t-\t-\t-\t-\n", job->line);
+  }
+  else if (job->merged != NULL && manifest->compute_digest)
+  {
+    printf("%lu\tmerged\t%ju\t%ju\t%ju\t%s\t%08" PRIx32 "\n", job->line, join_location, 
+      match_info->matching_bytes, match_info->total_bytes, job->merged, digest_value(digest));
+  }
+  else
+  {
+    printf("%lu\t%s\t%ju\t%ju\t%ju\t%s\t-\n", job->line, 
+      (job->merged != NULL ? "merged" : "found"), join_location, 
+      match_info->matching_bytes, match_info->total_bytes, 
+      (job->merged != NULL ? job->merged : "-"));
+  }
+}
+
+static void *worker_main(void *const data)
+{
+  manifest_t *const manifest = data;
+  file_info_t f1_info, f2_info;
+  const status_t alloc_status = alloc_file_buffers(&f1_info);
+  const status_t status = (alloc_status == LF_OK ? alloc_file_buffers(&f2_info) : alloc_status);
+
+  while(1)
+  {
+    pthread_mutex_lock(&manifest->mutex);
+    const size_t index = manifest->next_job++;
+    pthread_mutex_unlock(&manifest->mutex);
+
+    if (index >= manifest->job_count)
+      break;
+
+    const job_t *const job = &manifest->jobs[index];
+    status_t job_status = status;
+    int found = 0;
+    off_t join_location = 0;
+    match_info_t match_info;
+    digest_t digest;
+    dev_t devices[MAX_JOB_DEVICES];
+    size_t device_count = 0;
+
+    init_digest(&digest);
+    if (job_status == LF_OK)
+      job_status = get_job_devices(job, devices, &device_count);
+
+    if (job_status == LF_OK)
+    {
+      acquire_devices(&manifest->limiter, devices, device_count);
+      job_status = run_job(manifest, job, &f1_info, &f2_info, &found, &join_location, &match_info, &digest);
+      release_devices(&manifest->limiter, devices, device_count);
+    }
+
+    report_job(manifest, job, job_status, found, join_location, &match_info, &digest);
+
+    if (job_status != LF_OK || !found)
+    {
+      pthread_mutex_lock(&manifest->mutex);
+      ++manifest->failed_jobs;
+      pthread_mutex_unlock(&manifest->mutex);
+    }
+  }
+
+  if (alloc_status == LF_OK)
+    free_file_buffers(&f1_info);
+
+  if (status == LF_OK)
+    free_file_buffers(&f2_info);
+
+  return NULL;
+}
+
+static char *next_field(char **const line)
+{
+  char *const field = *line;
+  if (field == NULL)
+    return NULL;
+
+  char *const end = strchr(field, '\t');
+  if (end != NULL)
+  {
+    *end = '\0';
+    *line = end + 1;
+  }
+  else
+  {
+    *line = NULL;
+  }
+
+  return field;
+}
+
+static status_t read_line(FILE *const file, char **const line, size_t *const capacity, int *const eof)
+{
+  status_t _status = LF_INTERNAL_ERROR;
+  size_t length = 0;
+  *eof = 0;
+
+  while(1)
+  {
+    if (*capacity - length < 2)
+    {
+      const size_t new_capacity = (*capacity == 0 ? 256 : 2 * *capacity);
+      char *const new_line = realloc(*line, new_capacity);
+      FAIL_SYS(new_line == NULL);
+      *line = new_line;
+      *capacity = new_capacity;
+    }
+
+    if (fgets(*line + length, *capacity - length, file) == NULL)
+    {
+      FAIL_SYS(ferror(file));
+      *eof = (length == 0);
+      break;
+    }
+
+    length += strlen(*line + length);
+    if (length > 0 && (*line)[length - 1] == '\n')
+    {
+      (*line)[--length] = '\0';
+      break;
+    }
+  }
+
+  if (length > 0 && (*line)[length - 1] == '\r')
+    (*line)[--length] = '\0';
+
+  return LF_OK;
+
+fail:
+  return _status;
+}
+
+// Each line holds tab-separated paths of the two input files and, optionally,
+// the merged output. Blank lines and lines starting with '#' are ignored.
+static status_t parse_manifest(manifest_t *const manifest, const char *const path)
+{
+  status_t _status = LF_INTERNAL_ERROR;
+  FILE *file = NULL;
+  char *line = NULL;
+  size_t line_capacity = 0, job_capacity = 0;
+  unsigned long line_number = 0;
+  int eof;
+
+  FAIL_SYS((file = fopen(path, "r")) == NULL);
+
+  while(1)
+  {
+    FAIL_FORWARD(read_line(file, &line, &line_capacity, &eof));
+    if (eof)
+      break;
+
+    ++line_number;
+    if (line[0] == '\0' || line[0] == '#')
+      continue;
+
+    if (manifest->job_count == job_capacity)
+    {
+      const size_t new_capacity = (job_capacity == 0 ? 64 : 2 * job_capacity);
+      job_t *const new_jobs = realloc(manifest->jobs, new_capacity * sizeof(job_t));
+      FAIL_SYS(new_jobs == NULL);
+      manifest->jobs = new_jobs;
+      job_capacity = new_capacity;
+    }
+
+    job_t *const job = &manifest->jobs[manifest->job_count];
+    job->line = line_number;
+    FAIL_SYS((job->file1 = malloc(strlen(line) + 1)) == NULL);
+    strcpy(job->file1, line);
+    ++manifest->job_count;
+
+    char *rest = job->file1;
+    next_field(&rest);
+    job->file2 = next_field(&rest);
+    job->merged = next_field(&rest);
+
+    if (job->file2 == NULL || *job->file2 == '\0' || next_field(&rest) != NULL ||
+        (job->merged != NULL && (*job->merged == '\0' || 
+          strcmp(job->merged, job->file1) == 0 || strcmp(job->merged, job->file2) == 0)))
+    {
+      fprintf(stderr, "Invalid manifest entry on line %lu.\n", line_number);
+      FAIL_PRED(1, LF_INVALID_MANIFEST);
+    }
+  }
+
+  _status = LF_OK;
+
+fail:
+  free(line);
+  if (file != NULL && fclose(file) == EOF && _status == LF_OK)
+    _status = LF_FROM_SYS_ERROR(errno);
+
+  return _status;
+}
+
+status_t run_manifest(const char *const manifest_path, const long window_size, const int worker_count, 
+                      const int device_limit, const int compute_digest, int *const all_succeeded)
+{
+  status_t _status = LF_INTERNAL_ERROR;
+  pthread_t *workers = NULL;
+  int started = 0, sync_valid = 0;
+  manifest_t manifest;
+  manifest.window_size = window_size;
+  manifest.compute_digest = compute_digest;
+  manifest.job_count = 0;
+  manifest.jobs = NULL;
+  manifest.next_job = 0;
+  manifest.failed_jobs = 0;
+  manifest.limiter.limit = device_limit;
+  manifest.limiter.device_count = 0;
+  manifest.limiter.devices = NULL;
+  *all_succeeded = 0;
+
+  FAIL_FORWARD_MSG(parse_manifest(&manifest, manifest_path), "Couldn't read manifest.");
+  FAIL_SYS((manifest.limiter.devices = malloc((MAX_JOB_DEVICES * manifest.job_count + 1) * sizeof(device_use_t))) == NULL);
+  FAIL_SYS((workers = malloc(worker_count * sizeof(pthread_t))) == NULL);
+
+  FAIL_PRED(pthread_mutex_init(&manifest.mutex, NULL) != 0, LF_INTERNAL_ERROR);
+  FAIL_PRED(pthread_mutex_init(&manifest.limiter.mutex, NULL) != 0, LF_INTERNAL_ERROR);
+  FAIL_PRED(pthread_cond_init(&manifest.limiter.released, NULL) != 0, LF_INTERNAL_ERROR);
+  sync_valid = 1;
+
+  fprintf(stderr, "Running %zu jobs on %i workers using overlap window of %li bytes.\n", 
+    manifest.job_count, worker_count, window_size);
+
+  for(; started < worker_count; ++started)
+  {
+    const int error = pthread_create(&workers[started], NULL, worker_main, &manifest);
+    FAIL_PRED(error != 0, LF_FROM_SYS_ERROR(error));
+  }
+
+  _status = LF_OK;
+
+fail:
+  for(int i = 0; i < started; ++i)
+    pthread_join(workers[i], NULL);
+
+  if (_status == LF_OK)
+  {
+    fprintf(stderr, "Completed %zu jobs, %zu of which failed or found no overlap.\n", manifest.job_count, manifest.failed_jobs);
+    *all_succeeded = (manifest.failed_jobs == 0);
+  }
+
+  if (sync_valid)
+  {
+    pthread_mutex_destroy(&manifest.mutex);
+    pthread_mutex_destroy(&manifest.limiter.mutex);
+    pthread_cond_destroy(&manifest.limiter.released);
+  }
+
+  for(size_t i = 0; i < manifest.job_count; ++i)
+    free(manifest.jobs[i].file1);
+
+  free(manifest.jobs);
+  free(manifest.limiter.devices);
+  free(workers);
+  return _status;
+}
@@ -0,0 +1,230 @@
+/* Copyright (c) 2012 Francis Russell <francis@unchartedbackwaters.co.uk>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+// For copy_file_range and mkstemp
+#define _GNU_SOURCE
+
+#include "speculate.h"
+#include "file_info.h"
+#include "digest.h"
+#include "errors.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#if defined(__linux__) && defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+#define HAVE_COPY_FILE_RANGE
+#endif
+
+static int is_cancelled(speculation_t *const speculation)
+{
+  pthread_mutex_lock(&speculation->mutex);
+  const int cancelled = speculation->cancelled;
+  pthread_mutex_unlock(&speculation->mutex);
+  return cancelled;
+}
+
+static status_t copy_user_space(speculation_t *const speculation)
+{
+  status_t _status = LF_INTERNAL_ERROR;
+  unsigned char *buffer = NULL;
+  const size_t chunk_size = get_buffer_size();
+  FAIL_SYS((buffer = malloc(chunk_size)) == NULL);
+
+  ssize_t length;
+  while(!is_cancelled(speculation) && 
+    (length = read(speculation->source_fd, buffer, acquire_io(chunk_size, 2))) != 0)
+  {
+    FAIL_SYS(length == -1);
+    account_io(length, length);
+
+    if (speculation->digest != NULL)
+      update_digest(speculation->digest, buffer, length);
+
+    for(ssize_t offset = 0; offset < length; )
+    {
+      const ssize_t written = write(speculation->temp_fd, buffer + offset, length - offset);
+      FAIL_SYS(written == -1);
+      offset += written;
+    }
+  }
+
+  _status = LF_OK;
+
+fail:
+  free(buffer);
+  return _status;
+}
+
+static void *speculation_main(void *const data)
+{
+  speculation_t *const speculation = data;
+
+#ifdef HAVE_COPY_FILE_RANGE
+  // The data never needs to pass through user space unless it is digested.
+  // Cancellation and rate limiting are applied between chunks.
+  if (speculation->digest == NULL)
+  {
+    ssize_t copied = 0;
+    while(!is_cancelled(speculation) && 
+      (copied = copy_file_range(speculation->source_fd, NULL, speculation->temp_fd, NULL, 
+        acquire_io(get_buffer_size(), 2), 0)) > 0)
+      account_io(copied, copied);
+
+    if (copied == 0 || is_cancelled(speculation))
+    {
+      speculation->status = LF_OK;
+      return NULL;
+    }
+
+    // Fall back for files the kernel cannot copy between, provided nothing
+    // has been copied yet.
+    if ((errno != ENOSYS && errno != EXDEV && errno != EINVAL && errno != EOPNOTSUPP) || 
+        lseek(speculation->temp_fd, 0, SEEK_CUR) != 0)
+    {
+      speculation->status = LF_FROM_SYS_ERROR(errno);
+      return NULL;
+    }
+  }
+#endif
+
+  speculation->status = copy_user_space(speculation);
+  return NULL;
+}
+
+status_t start_speculation(speculation_t *const speculation, const char *const file1, 
+                           const char *const merged, digest_t *const digest)
+{
+  status_t _status = LF_INTERNAL_ERROR;
+  const char *const suffix = ".XXXXXX";
+  int mutex_valid = 0;
+  speculation->merged = merged;
+  speculation->digest = digest;
+  speculation->cancelled = 0;
+  speculation->joined = 0;
+  speculation->status = LF_INTERNAL_ERROR;
+  speculation->source_fd = speculation->temp_fd = -1;
+  speculation->temp_path = NULL;
+
+  // The temporary file lives beside the output so it can be renamed into place
+  FAIL_SYS((speculation->temp_path = malloc(strlen(merged) + strlen(suffix) + 1)) == NULL);
+  strcpy(speculation->temp_path, merged);
+  strcat(speculation->temp_path, suffix);
+
+  FAIL_SYS((speculation->source_fd = open(file1, O_RDONLY)) == -1);
+  FAIL_SYS((speculation->temp_fd = mkstemp(speculation->temp_path)) == -1);
+
+  // Match the permissions the output would have had if opened directly
+  const mode_t mask = umask(0);
+  umask(mask);
+  FAIL_SYS(fchmod(speculation->temp_fd, 0666 & ~mask) == -1);
+
+  FAIL_PRED(pthread_mutex_init(&speculation->mutex, NULL) != 0, LF_INTERNAL_ERROR);
+  mutex_valid = 1;
+
+  const int error = pthread_create(&speculation->thread, NULL, speculation_main, speculation);
+  FAIL_PRED(error != 0, LF_FROM_SYS_ERROR(error));
+  return LF_OK;
+
+fail:
+  if (mutex_valid)
+    pthread_mutex_destroy(&speculation->mutex);
+
+  if (speculation->temp_fd != -1)
+  {
+    close(speculation->temp_fd);
+    unlink(speculation->temp_path);
+  }
+
+  if (speculation->source_fd != -1)
+    close(speculation->source_fd);
+
+  free(speculation->temp_path);
+  return _status;
+}
+
+static void join_speculation(speculation_t *const speculation)
+{
+  if (!speculation->joined)
+  {
+    pthread_join(speculation->thread, NULL);
+    pthread_mutex_destroy(&speculation->mutex);
+    close(speculation->source_fd);
+    speculation->joined = 1;
+  }
+}
+
+status_t finish_speculation(speculation_t *const speculation, FILE **const out)
+{
+  status_t _status = LF_INTERNAL_ERROR;
+  join_speculation(speculation);
+  FAIL_FORWARD(speculation->status);
+
+  // The descriptor is left positioned after the copy of the first file
+  FAIL_SYS((*out = fdopen(speculation->temp_fd, "wb")) == NULL);
+  return LF_OK;
+
+fail:
+  return _status;
+}
+
+status_t commit_speculation(speculation_t *const speculation, FILE *const out)
+{
+  status_t _status = LF_INTERNAL_ERROR;
+  const int close_failed = (fclose(out) == EOF);
+  speculation->temp_fd = -1;
+  FAIL_SYS(close_failed);
+  FAIL_SYS(rename(speculation->temp_path, speculation->merged) == -1);
+  free(speculation->temp_path);
+  return LF_OK;
+
+fail:
+  abandon_speculation(speculation, NULL);
+  return _status;
+}
+
+void abandon_speculation(speculation_t *const speculation, FILE *const out)
+{
+  if (!speculation->joined)
+  {
+    pthread_mutex_lock(&speculation->mutex);
+    speculation->cancelled = 1;
+    pthread_mutex_unlock(&speculation->mutex);
+  }
+
+  join_speculation(speculation);
+
+  if (out != NULL)
+    fclose(out);
+  else if (speculation->temp_fd != -1)
+    close(speculation->temp_fd);
+
+  unlink(speculation->temp_path);
+  free(speculation->temp_path);
+}
@@ -0,0 +1,57 @@
+/* Copyright (c) 2012 Francis Russell <francis@unchartedbackwaters.co.uk>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef SPECULATE_H
+#define SPECULATE_H
+
+#include <stdio.h>
+#include <pthread.h>
+#include "errors.h"
+#include "digest.h"
+
+// Copies the first file to a temporary output on a background thread while
+// the second file is being searched. Since the merged file always starts
+// with all of the first, only the tail of the second remains to be appended
+// once the join location is known.
+
+typedef struct
+{
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  int cancelled;
+  int joined;
+  const char *merged;
+  char *temp_path;
+  int source_fd;
+  int temp_fd;
+  digest_t *digest;
+  status_t status;
+} speculation_t;
+
+status_t start_speculation(speculation_t *speculation, const char *file1, const char *merged, digest_t *digest);
+status_t finish_speculation(speculation_t *speculation, FILE **out);
+status_t commit_speculation(speculation_t *speculation, FILE *out);
+void abandon_speculation(speculation_t *speculation, FILE *out);
+
+#endif